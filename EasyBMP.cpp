@@ -21,16 +21,56 @@
 #include "EasyBMP.h"
 #include <exception>
 #include <fstream>
+#include <cstdint>
+#include <cstdlib>
+#include <limits>
+#include <atomic>
+#include <condition_variable>
+#include <deque>
+#include <functional>
+#include <mutex>
+#include <thread>
+
+#if defined(__SSE2__) or defined(_M_X64) or (defined(_M_IX86_FP) and _M_IX86_FP >= 2)
+#define EasyBMP_SSE2
+#include <emmintrin.h>
+#endif
+
+#ifdef __SSSE3__
+#include <tmmintrin.h>
+#endif
+
+#ifdef __AVX2__
+#include <immintrin.h>
+#endif
 
 using namespace std;
 
 /* These functions are defined in EasyBMP.h */
 
-static bool g_exceptions = true;
+// Each thread has its own error policy, so one thread turning exceptions
+// off never changes what another thread's calls do. Work handed to the
+// thread pool runs under the policy of the thread that submitted it.
+static thread_local bool g_exceptions = true;
+
+// The decoding limits are per thread for the same reason.
+static thread_local BMPLimits g_limits = BMPLimits();
 
 bool BMP::exceptions(void)       { return g_exceptions; }
 void BMP::exceptions(bool flag)  { g_exceptions = flag; }
 
+// New images take their pixel memory from this thread's allocator.
+static thread_local BMPAllocator* g_allocator = nullptr;
+
+BMPAllocator& BMP::allocator(void)                  { return g_allocator ? *g_allocator : BMPAllocator::Pooled(); }
+void BMP::allocator(BMPAllocator* NewAllocator)     { g_allocator = NewAllocator; }
+
+BMPLimits BMP::limits(void)                   { return g_limits; }
+void BMP::limits(const BMPLimits& NewLimits)  { g_limits = NewLimits; }
+
+BMP::ExceptionScope::ExceptionScope(bool flag) : Previous(g_exceptions) { g_exceptions = flag; }
+BMP::ExceptionScope::~ExceptionScope()                                  { g_exceptions = Previous; }
+
 /* These functions are defined in EasyBMP_DataStructures.h */
 
 int IntPow(int base, int exponent)
@@ -107,25 +147,206 @@ void BMFH::display(void)
 		 << "bfOffBits: " << (int) bfOffBits << endl << endl;
 }
 
-/* These functions are defined in EasyBMP_BMP.h */
+/* These functions are defined in EasyBMP_View.h */
+
+BMPView::BMPView()
+	: Origin(nullptr), Width(0), Height(0), ColumnStride(0), RowStride(0)
+{
+}
+
+// BMP stores its pixels column after column in one block, which the view
+// pins: see BMP::Pin()
+BMPView::BMPView(BMP& Image)
+	: Origin(Image.Pin()), Width(Image.AbsWidth()), Height(Image.AbsHeight()),
+	  ColumnStride(Image.AbsHeight()), RowStride(1)
+{
+}
+
+// A read-only view points straight into the pixels, shared or not, as
+// long as they are still one block.
+BMPView::BMPView(const BMP& Image)
+	: BMPView()
+{
+	if (not Image.Copies.empty()) return;
+	Origin = Image.Data;
+	Width = Image.AbsWidth();
+	Height = Image.AbsHeight();
+	ColumnStride = Image.AbsHeight();
+	RowStride = 1;
+}
+
+BMPView::BMPView(RGBApixel* Origin, int Width, int Height,
+				 ptrdiff_t ColumnStride, ptrdiff_t RowStride)
+	: Origin(Origin), Width(Width), Height(Height),
+	  ColumnStride(ColumnStride), RowStride(RowStride)
+{
+}
+
+BMPView BMPView::Crop(int Left, int Top, int NewWidth, int NewHeight) const
+{
+	// make sure that the cropped region exists in this view
+	if (Left < 0) { NewWidth += Left; Left = 0; }
+	if (Top < 0)  { NewHeight += Top; Top = 0; }
+	if (Left + NewWidth > Width)  NewWidth = Width - Left;
+	if (Top + NewHeight > Height) NewHeight = Height - Top;
+	if (NewWidth <= 0 or NewHeight <= 0) return BMPView();
+
+	return BMPView(&(*this)(Left, Top), NewWidth, NewHeight, ColumnStride, RowStride);
+}
+
+BMPView BMPView::FlipHorizontal(void) const
+{
+	if (Width <= 0) return *this;
+	return BMPView(&(*this)(Width - 1, 0), Width, Height, -ColumnStride, RowStride);
+}
+
+BMPView BMPView::FlipVertical(void) const
+{
+	if (Height <= 0) return *this;
+	return BMPView(&(*this)(0, Height - 1), Width, Height, ColumnStride, -RowStride);
+}
+
+PixelBuffer::PixelBuffer()
+	: Data(nullptr), Width(0), Height(0), Stride(0), Format(PixelFormat::BGRA8)
+{
+}
+
+PixelBuffer::PixelBuffer(const void* Data, int Width, int Height,
+						 ptrdiff_t Stride, PixelFormat Format)
+	: Data(Data), Width(Width), Height(Height), Stride(Stride), Format(Format)
+{
+}
+
+/* These functions are defined in EasyBMP_Allocator.h */
+
+// Blocks come from malloc, over-allocated and aligned by hand, with the
+// address malloc returned stored just in front of the block.
+
+static void* AlignedAllocate(size_t Size)
+{
+	const size_t Extra = BMPAllocator::Alignment + sizeof(void*);
+	if (Size > numeric_limits<size_t>::max() - Extra) throw bad_alloc();
+	void* Raw = malloc(Size + Extra);
+	if (not Raw) throw bad_alloc();
+	uintptr_t Start = ((uintptr_t) Raw + sizeof(void*) + BMPAllocator::Alignment - 1)
+					  & ~(uintptr_t) (BMPAllocator::Alignment - 1);
+	((void**) Start)[-1] = Raw;
+	return (void*) Start;
+}
 
-struct ReadBuf : public std::streambuf
+static void AlignedFree(void* Block)
 {
-	ReadBuf(char* s, std::size_t n)
+	if (Block) free(((void**) Block)[-1]);
+}
+
+// Sizes are rounded up to a power of two from 64 bytes to 4 MiB, and a
+// freed block goes onto the list for its size until that list holds
+// about 8 MiB. Larger blocks go straight back to the system.
+
+class PooledAllocator : public BMPAllocator {
+public:
+	void* Allocate(size_t Size)
+	{
+		int Class = ClassOf(Size);
+		if (Class < 0) return AlignedAllocate(Size);
+		{
+			lock_guard<mutex> Lock(Pools[Class].Lock);
+			vector<void*>& Free = Pools[Class].Free;
+			if (not Free.empty()) {
+				void* Block = Free.back();
+				Free.pop_back();
+				return Block;
+			}
+		}
+		return AlignedAllocate(SizeOf(Class));
+	}
+
+	void Deallocate(void* Block, size_t Size)
+	{
+		if (not Block) return;
+		int Class = ClassOf(Size);
+		if (Class >= 0) {
+			lock_guard<mutex> Lock(Pools[Class].Lock);
+			vector<void*>& Free = Pools[Class].Free;
+			if (Free.size() < max<size_t>(2, Kept / SizeOf(Class))) {
+				Free.push_back(Block);
+				return;
+			}
+		}
+		AlignedFree(Block);
+	}
+
+private:
+	static const int Classes = 17;
+	static const size_t Kept = 8 << 20;
+
+	static size_t SizeOf(int Class) { return (size_t) Alignment << Class; }
+
+	static int ClassOf(size_t Size)
 	{
-		setg(s, s, s + n);
+		for (int Class = 0; Class < Classes; Class++) {
+			if (Size <= SizeOf(Class)) return Class;
+		}
+		return -1;
 	}
+
+	struct Pool {
+		mutex Lock;
+		vector<void*> Free;
+	};
+	Pool Pools[Classes];
 };
 
-bool SafeFread(char* buffer, int size, int number, istream& in)
+// Never destroyed: scratch rows in thread_local storage and images in
+// static storage may hand memory back to it during shutdown.
+BMPAllocator& BMPAllocator::Pooled(void)
+{
+	static PooledAllocator* Pool = new PooledAllocator;
+	return *Pool;
+}
+
+BMPArena::BMPArena(size_t ChunkSize, BMPAllocator& Upstream)
+	: Next(nullptr), Left(0), ChunkSize(ChunkSize), Upstream(&Upstream)
+{
+}
+
+BMPArena::~BMPArena()
+{
+	Release();
+}
+
+void* BMPArena::Allocate(size_t Size)
 {
-	if (in.eof()) return false;
-	streamsize bytesRequested = size * number;
-	in.read(buffer, bytesRequested);
+	size_t Rounded = (Size + Alignment - 1) / Alignment * Alignment;
+	if (Rounded < Size) throw bad_alloc();
+	if (Rounded > Left) {
+		// oversized requests get a chunk of their own and leave the
+		// current chunk open for the next small one
+		size_t Bytes = max(Rounded, ChunkSize);
+		Chunks.reserve(Chunks.size() + 1);
+		char* Block = (char*) Upstream->Allocate(Bytes);
+		Chunks.push_back(Chunk{Block, Bytes});
+		if (Bytes > ChunkSize) return Block;
+		Next = Block;
+		Left = Bytes;
+	}
+	void* Block = Next;
+	Next += Rounded;
+	Left -= Rounded;
+	return Block;
+}
 
-	return in.gcount() == bytesRequested;
+void BMPArena::Release(void)
+{
+	for (size_t k = 0; k < Chunks.size(); k++) {
+		Upstream->Deallocate(Chunks[k].Block, Chunks[k].Size);
+	}
+	Chunks.clear();
+	Next = nullptr;
+	Left = 0;
 }
 
+/* These functions are defined in EasyBMP_BMP.h */
 
 RGBApixel BMP::GetPixel(int i, int j) const
 {
@@ -142,7 +363,7 @@ RGBApixel BMP::GetPixel(int i, int j) const
 
 bool BMP::SetPixel( int i, int j, RGBApixel NewPixel )
 {
-	Pixels[i][j] = NewPixel;
+	WritableColumn(i)[j] = NewPixel;
 	return true;
 }
 
@@ -173,7 +394,7 @@ bool BMP::SetColor( int ColorNumber , RGBApixel NewColor )
 }
 
 // RGBApixel BMP::GetColor( int ColorNumber ) const
-RGBApixel BMP::GetColor(int ColorNumber)
+RGBApixel BMP::GetColor(int ColorNumber) const
 {
 	RGBApixel Output;
 	Output.Red   = 255;
@@ -205,13 +426,17 @@ RGBApixel BMP::GetColor(int ColorNumber)
 	return Output;
 }
 
-BMP::BMP()
+BMP::BMP() : BMP(allocator())
+{
+}
+
+BMP::BMP(BMPAllocator& Allocator)
 {
-	Width = 1;
-	Height = 1;
+	Memory = &Allocator;
+	Pixels = nullptr;
+	Share = nullptr;
+	AllocatePixels(1, 1);
 	BitDepth = 24;
-	Pixels = new RGBApixel* [Width];
-	Pixels[0] = new RGBApixel [Height];
 	Colors = nullptr;
 
 	XPelsPerMeter = 0;
@@ -223,36 +448,35 @@ BMP::BMP()
 	SizeOfMetaData2 = 0;
 }
 
-// BMP::BMP( const BMP& Input )
-BMP::BMP(BMP& Input)
-{
-	// first, make the image empty.
+// A copy shares the pixels of Input until one of the two writes to them,
+// and then only the columns written to are duplicated. It takes memory
+// from Input's allocator, so that the two can share.
 
-	Width = 1;
-	Height = 1;
-	BitDepth = 24;
-	Pixels = new RGBApixel* [Width];
-	Pixels[0] = new RGBApixel [Height];
-	Colors = nullptr;
-	XPelsPerMeter = 0;
-	YPelsPerMeter = 0;
+BMP::BMP(const BMP& Input) : BMP(*Input.Memory)
+{
+	*this = Input;
+}
 
-	MetaData1 = nullptr;
-	SizeOfMetaData1 = 0;
-	MetaData2 = nullptr;
-	SizeOfMetaData2 = 0;
+BMP& BMP::operator=(const BMP& Input)
+{
+	if (this == &Input) return *this;
 
-	// now, set the correct bit depth
+	// set the correct bit depth
 
 	SetBitDepth(Input.TellBitDepth());
 
-	// set the correct pixel size
+	// take the pixels, and with them the size and orientation
 
-	SetSize(Input.TellWidth(), Input.TellHeight());
+	SharePixels(Input);
+	HorizontalFlip = Input.HorizontalFlip;
+	VerticalFlip = Input.VerticalFlip;
+	RLECompression = Input.RLECompression;
 
-	// set the DPI information from Input
+	// take the resolution as stored, since converting it to DPI and back
+	// rounds it
 
-	SetDPI(Input.TellHorizontalDPI(), Input.TellVerticalDPI());
+	XPelsPerMeter = Input.XPelsPerMeter;
+	YPelsPerMeter = Input.YPelsPerMeter;
 
 	// if there is a color table, get all the colors
 
@@ -263,27 +487,34 @@ BMP::BMP(BMP& Input)
 			SetColor(k, Input.GetColor(k));
 		}
 	}
-
-	// get all the pixels
-
-	for (int j = 0; j < Height; j++) {
-		for (int i = 0; i < Width; i++) {
-			Pixels[i][j] = Input(i,j);
-		//   Pixels[i][j] = Input.GetPixel(i,j); // *Input(i,j);
-		}
-	}
+	return *this;
 }
 
 BMP::~BMP()
 {
-	for (int i = 0; i < Width; i++) delete [] Pixels[i];
-	delete [] Pixels;
-	delete [] Colors;
+	FreePixels();
+	FreeColors();
 	delete [] MetaData1;
 	delete [] MetaData2;
 }
 
+// Writing may need the column copied first if it is shared with a copy
+// of this image, so the reference stays valid until the image is next
+// copied or resized.
+
 RGBApixel& BMP::operator()(int i, int j)
+{
+	ClampPixel(i, j);
+	return WritableColumn(i)[j];
+}
+
+const RGBApixel& BMP::operator()(int i, int j) const
+{
+	ClampPixel(i, j);
+	return Pixels[i][j];
+}
+
+void BMP::ClampPixel(int& i, int& j) const
 {
 	bool Warn = false;
 	if (i < 0 )      { i = 0; Warn = true; }
@@ -293,22 +524,21 @@ RGBApixel& BMP::operator()(int i, int j)
 	if (Warn and g_exceptions) {
 		throw invalid_argument("EasyBMP: attempted to access non-existent pixel");
 	}
-	return Pixels[i][j];
 }
 
 // int BMP::TellBitDepth( void ) const
-int BMP::TellBitDepth(void) { return BitDepth; }
+int BMP::TellBitDepth(void) const { return BitDepth; }
 
 // int BMP::TellHeight( void ) const
-int BMP::TellHeight(void) { return VerticalFlip ? -Height : Height; }
-int BMP::AbsHeight(void) { return Height; }
+int BMP::TellHeight(void) const { return VerticalFlip ? -Height : Height; }
+int BMP::AbsHeight(void) const { return Height; }
 
 // int BMP::TellWidth( void ) const
-int BMP::TellWidth(void) { return HorizontalFlip ? -Width : Width; }
-int BMP::AbsWidth(void) { return Width; }
+int BMP::TellWidth(void) const { return HorizontalFlip ? -Width : Width; }
+int BMP::AbsWidth(void) const { return Width; }
 
 // int BMP::TellNumberOfColors( void ) const
-int BMP::TellNumberOfColors(void)
+int BMP::TellNumberOfColors(void) const
 {
 	int output = IntPow(2, BitDepth);
 	if (BitDepth == 32) { output = IntPow(2, 24); }
@@ -327,14 +557,12 @@ bool BMP::SetBitDepth(int NewDepth)
 		return false;
 	}
 
+	// the color table is only reallocated when its size changes
+	bool SameTable = Colors and NewDepth == BitDepth;
 	BitDepth = NewDepth;
-	delete [] Colors;
-	int NumberOfColors = IntPow(2, BitDepth);
-	if (BitDepth == 1 or BitDepth == 4 or BitDepth == 8) {
-		Colors = new RGBApixel [NumberOfColors];
-	}
-	else {
-		Colors = nullptr;
+	if (not SameTable) {
+		FreeColors();
+		if (BitDepth == 1 or BitDepth == 4 or BitDepth == 8) AllocateColors();
 	}
 	if (BitDepth == 1 or BitDepth == 4 or BitDepth == 8) {
 		CreateStandardColorTable();
@@ -343,6 +571,26 @@ bool BMP::SetBitDepth(int NewDepth)
 	return true;
 }
 
+// Bytes for the column table of a Width-wide image, padded to the
+// allocator alignment.
+
+static unsigned long long ColumnTableBytes(long long Width)
+{
+	const unsigned long long Align = BMPAllocator::Alignment;
+	return ((unsigned long long) Width * sizeof(RGBApixel*) + Align - 1) / Align * Align;
+}
+
+// Whether Width x Height pixels, and the byte count of that block, can
+// be represented: both sides within int and the total within size_t.
+
+static bool PixelCountFits(long long Width, long long Height)
+{
+	const unsigned long long Most = numeric_limits<size_t>::max();
+	return Width <= numeric_limits<int>::max() and Height <= numeric_limits<int>::max() and
+		   (unsigned long long) Width * (unsigned long long) Height <=
+		   (Most - ColumnTableBytes(Width)) / sizeof(RGBApixel);
+}
+
 bool BMP::SetSize(int NewWidth , int NewHeight )
 {
 	if (NewWidth == 0 or NewHeight == 0)
@@ -352,564 +600,1700 @@ bool BMP::SetSize(int NewWidth , int NewHeight )
 		}
 		return false;
 	}
-
-	int i, j;
-
-	for (i = 0; i < Width; i++) delete [] Pixels[i];
-	delete [] Pixels;
+	if (not PixelCountFits(llabs(NewWidth), llabs(NewHeight))) {
+		if (g_exceptions) {
+			throw length_error("EasyBMP::SetSize: " + to_string(NewWidth) + "x" + to_string(NewHeight) +
+							   " pixels do not fit in memory on this platform.");
+		}
+		return false;
+	}
 
 	if (NewWidth < 0)
 		HorizontalFlip = true;
 	if (NewHeight < 0)
 		VerticalFlip = true;
 
-	Width = abs(NewWidth);
-	Height = abs(NewHeight);
-	Pixels = new RGBApixel* [ Width ];
+	AllocatePixels(abs(NewWidth), abs(NewHeight));
 
-	for (i = 0; i < Width; i++)
-		Pixels[i] = new RGBApixel[Height];
+	RGBApixel WHITE;
+	WHITE.Red = 255;
+	WHITE.Green = 255;
+	WHITE.Blue = 255;
+	WHITE.Alpha = 0;
+	fill(Pixels[0], Pixels[0] + (size_t) Width * Height, WHITE);
 
-	for (i = 0; i < Width ; i++)
-	{
-		for (j = 0; j < Height ; j++)
-		{
-			Pixels[i][j].Red = 255;
-			Pixels[i][j].Green = 255;
-			Pixels[i][j].Blue = 255;
-			Pixels[i][j].Alpha = 0;
+	return true;
+}
+
+// Copies share pixels until one of them writes. Share counts the images
+// whose columns point into Data; the last one to let go of it frees it.
+// Block is where Data was allocated, along with the column table of the
+// image that allocated it.
+
+struct BMP::PixelShare {
+	atomic<int> Owners;
+	ebmpBYTE* Block;
+};
+
+// Guards the list of copied columns while a shared column is copied out.
+// It is only taken the first time each shared column is written.
+static mutex CopyOnWrite;
+
+// Makes room for NewWidth x NewHeight pixels, keeping the current block
+// when the size is unchanged and nothing else shares it. The pixel values
+// are left as they are.
+
+void BMP::AllocatePixels(int NewWidth, int NewHeight)
+{
+	if (Pixels and NewWidth == Width and NewHeight == Height and
+		Copies.empty() and (not Share.load() or Share.load()->Owners == 1)) {
+		Pinned = false;
+		return;
+	}
+
+	// The pixels live in one contiguous block, column after column, so a
+	// column is a contiguous run and BMPView can describe any region with
+	// two strides. Pixels[i] points at the start of column i. The new
+	// block is allocated before the old one is freed, so a failed
+	// allocation leaves the image intact.
+	// The column table and the pixels share one allocation, the pixels
+	// starting at the first aligned address after the table. Small images
+	// use the inline storage and allocate nothing.
+	size_t Table = (size_t) ColumnTableBytes(NewWidth);
+	size_t Bytes = Table + (size_t) NewWidth * NewHeight * sizeof(RGBApixel);
+	ebmpBYTE* Block;
+	if (Bytes <= InlineBytes) {
+		FreePixels();
+		Block = InlineStorage();
+	}
+	else {
+		Block = (ebmpBYTE*) Memory->Allocate(Bytes);
+		FreePixels();
+	}
+
+	Pixels = (RGBApixel**) Block;
+	Data = (RGBApixel*) (Block + Table);
+	Width = NewWidth;
+	Height = NewHeight;
+	Pinned = false;
+
+	for (int i = 0; i < Width; i++)
+		Pixels[i] = Data + (size_t) i * Height;
+}
+
+// Returns the pixels to the allocator. Nothing in the pixels or the
+// column table is read on the way, so this is safe after an arena has
+// released them.
+
+void BMP::FreePixels(void)
+{
+	if (not Pixels) return;
+	size_t Table = (size_t) ColumnTableBytes(Width);
+	size_t Bytes = (size_t) Width * Height * sizeof(RGBApixel);
+	for (size_t k = 0; k < Copies.size(); k++) {
+		Memory->Deallocate(Copies[k], Height * sizeof(RGBApixel));
+	}
+	Copies.clear();
+	PixelShare* Shared = Share.load();
+	if (Shared) {
+		if ((ebmpBYTE*) Pixels + Table != (ebmpBYTE*) Data) Memory->Deallocate(Pixels, Table);
+		if (Shared->Owners.fetch_sub(1) == 1) {
+			Memory->Deallocate(Shared->Block, Table + Bytes);
+			delete Shared;
 		}
 	}
+	else if ((ebmpBYTE*) Pixels != InlineStorage()) {
+		Memory->Deallocate(Pixels, Table + Bytes);
+	}
+	Pixels = nullptr;
+	Data = nullptr;
+	Share = nullptr;
+}
 
-	return true;
+ebmpBYTE* BMP::InlineStorage(void) const
+{
+	const uintptr_t Align = BMPAllocator::Alignment;
+	return (ebmpBYTE*) Inline + (Align - (uintptr_t) Inline % Align) % Align;
 }
 
-bool BMP::WriteToFile(const string& FileName)
+// Makes this image's pixels a copy of Input's. The columns Input has not
+// written since it was last copied are shared, not copied; the others are
+// duplicated, as is everything when the two images take memory from
+// different allocators, when Input is small enough to be stored inline or
+// when a view may be writing to Input.
+
+void BMP::SharePixels(const BMP& Input)
 {
-	if (not EasyBMPcheckDataSize()) {
-		if (g_exceptions) {
-			throw runtime_error(string("EasyBMP::WriteToFile: data types are wrong size! ") +
-								"You may need to mess with EasyBMP_DataTypes.h to fix these errors, and then recompile. " +
-								"All 32-bit and 64-bit machines should be supported, however.");
+	if (Input.Memory != Memory or Input.Pinned or (ebmpBYTE*) Input.Pixels == Input.InlineStorage()) {
+		AllocatePixels(Input.Width, Input.Height);
+		for (int i = 0; i < Width; i++) {
+			memcpy(Pixels[i], Input.Pixels[i], Height * sizeof(RGBApixel));
 		}
-		return false;
+		return;
 	}
 
-	FILE* fp = fopen(FileName.c_str(), "wb");
-	if (not fp) {
-		if (g_exceptions) {
-			throw runtime_error("EasyBMP::WriteToFile: cannot open file " + FileName + " for output.");
+	size_t Table = (size_t) ColumnTableBytes(Input.Width);
+	size_t ColumnBytes = Input.Height * sizeof(RGBApixel);
+	RGBApixel** Columns = (RGBApixel**) Memory->Allocate(Table);
+	vector<RGBApixel*> NewCopies;
+	PixelShare* Shared = Input.Share.load(memory_order_acquire);
+	PixelShare* NewShare = nullptr;
+	try {
+		NewCopies.reserve(Input.Copies.size());
+		for (size_t k = 0; k < Input.Copies.size(); k++) {
+			NewCopies.push_back((RGBApixel*) Memory->Allocate(ColumnBytes));
 		}
-		return false;
+		if (not Shared) NewShare = new PixelShare;
+	}
+	catch (...) {
+		for (size_t k = 0; k < NewCopies.size(); k++) Memory->Deallocate(NewCopies[k], ColumnBytes);
+		Memory->Deallocate(Columns, Table);
+		throw;
+	}
+
+	// The first copy of an image starts counting the images that share
+	// its pixels. Share is the only state of Input a copy changes; it is
+	// set once, atomically, so copies made from several threads at once
+	// agree on a single count.
+	if (NewShare) {
+		NewShare->Owners = 1;
+		NewShare->Block = (ebmpBYTE*) Input.Pixels;
+		if (Input.Share.compare_exchange_strong(Shared, NewShare, memory_order_acq_rel))
+			Shared = NewShare;
+		else
+			delete NewShare;
+	}
+	Shared->Owners++;
+
+	// columns still in Data are shared, the ones Input copied out are
+	// duplicated
+	FreePixels();
+	Pixels = Columns;
+	Data = Input.Data;
+	Share = Shared;
+	Copies.swap(NewCopies);
+	Width = Input.Width;
+	Height = Input.Height;
+	Pinned = false;
+	size_t Next = 0;
+	for (int i = 0; i < Width; i++) {
+		if (Input.Pixels[i] == Input.Data + (size_t) i * Input.Height) {
+			Pixels[i] = Input.Pixels[i];
+			continue;
+		}
+		Pixels[i] = Copies[Next++];
+		memcpy(Pixels[i], Input.Pixels[i], ColumnBytes);
 	}
+}
 
-	// some preliminaries
+// Column i may be written in place unless it still lies in Data while
+// another image shares Data.
 
-	double dBytesPerPixel = ( (double) BitDepth ) / 8.0;
-	double dBytesPerRow = dBytesPerPixel * (Width + 0.0);
-	dBytesPerRow = ceil(dBytesPerRow);
+RGBApixel* BMP::WritableColumn(int i)
+{
+	PixelShare* Shared = Share.load(memory_order_acquire);
+	if (not Shared or Pixels[i] != Data + (size_t) i * Height or Shared->Owners == 1)
+		return Pixels[i];
+	return CopyColumn(i);
+}
 
-	int BytePaddingPerRow = 4 - ( (int) (dBytesPerRow) ) % 4;
-	if (BytePaddingPerRow == 4)
-		BytePaddingPerRow = 0;
+// Gives column i pixels of its own before it is written. While another
+// image still shares the column it is copied out to an allocation of its
+// own; once none does it is written in place.
 
-	double dActualBytesPerRow = dBytesPerRow + BytePaddingPerRow;
+RGBApixel* BMP::CopyColumn(int i)
+{
+	RGBApixel* Target = nullptr;
+	{
+		lock_guard<mutex> Lock(CopyOnWrite);
+		if (Share.load()->Owners > 1) {
+			// room for every column at once, so copying them all out
+			// costs no reallocation
+			if (Copies.capacity() < (size_t) Width) Copies.reserve(Width);
+			Target = (RGBApixel*) Memory->Allocate(Height * sizeof(RGBApixel));
+			Copies.push_back(Target);
+		}
+	}
+	if (Target) {
+		memcpy(Target, Pixels[i], Height * sizeof(RGBApixel));
+		Pixels[i] = Target;
+	}
+	return Pixels[i];
+}
 
-	double dTotalPixelBytes = Height * dActualBytesPerRow;
+// Makes every column this image's own and the pixels one contiguous block
+// again, for a view to point into. The image stays pinned until its
+// pixels are replaced by SetSize or a read: copies made meanwhile
+// duplicate the pixels rather than share them, since the view may still
+// write to them.
 
-	double dPaletteSize = 0;
-	if (BitDepth == 1 or BitDepth == 4 or BitDepth == 8) {
-		dPaletteSize = IntPow(2,BitDepth)*4.0;
+RGBApixel* BMP::Pin(void)
+{
+	PixelShare* Shared = Share.load();
+	if (not Copies.empty() or (Shared and Shared->Owners > 1)) {
+		size_t Table = (size_t) ColumnTableBytes(Width);
+		size_t Bytes = (size_t) Width * Height * sizeof(RGBApixel);
+		ebmpBYTE* Block = (ebmpBYTE*) Memory->Allocate(Table + Bytes);
+		RGBApixel** Columns = (RGBApixel**) Block;
+		RGBApixel* First = (RGBApixel*) (Block + Table);
+		for (int i = 0; i < Width; i++) {
+			Columns[i] = First + (size_t) i * Height;
+			memcpy(Columns[i], Pixels[i], Height * sizeof(RGBApixel));
+		}
+		FreePixels();
+		Pixels = Columns;
+		Data = First;
 	}
+	Pinned = true;
+	return Data;
+}
 
-	// leave some room for 16-bit masks
-	if (BitDepth == 16) dPaletteSize = 3*4;
+// The color table always has room for 256 entries, whatever the bit
+// depth, so it goes back to the allocator without remembering its size.
 
-	double dTotalFileSize = 14 + 40 + dPaletteSize + dTotalPixelBytes;
+static const size_t ColorTableBytes = 256 * sizeof(RGBApixel);
 
-	// write the file header
-	BMFH bmfh;
-	bmfh.bfSize = (ebmpDWORD) dTotalFileSize;
-	bmfh.bfReserved1 = 0;
-	bmfh.bfReserved2 = 0;
-	bmfh.bfOffBits = (ebmpDWORD) (14+40+dPaletteSize);
+void BMP::AllocateColors(void)
+{
+	Colors = (RGBApixel*) Memory->Allocate(ColorTableBytes);
+}
 
-	if (IsBigEndian()) bmfh.SwitchEndianess();
+void BMP::FreeColors(void)
+{
+	if (Colors) Memory->Deallocate(Colors, ColorTableBytes);
+	Colors = nullptr;
+}
 
-	fwrite( (char*) &(bmfh.bfType), sizeof(ebmpWORD), 1, fp );
-	fwrite( (char*) &(bmfh.bfSize), sizeof(ebmpDWORD), 1, fp );
-	fwrite( (char*) &(bmfh.bfReserved1), sizeof(ebmpWORD), 1, fp );
-	fwrite( (char*) &(bmfh.bfReserved2), sizeof(ebmpWORD), 1, fp );
-	fwrite( (char*) &(bmfh.bfOffBits), sizeof(ebmpDWORD), 1, fp );
+bool BMP::WriteToFile(const string& FileName)
+{
+	return bool(EncodeToFile(FileName, Width, Height, Rows()));
+}
 
-	// write the info header
-	BMIH bmih;
-	bmih.biSize = 40;
-	bmih.biWidth = HorizontalFlip ? -Width : Width;
-	bmih.biHeight = VerticalFlip ? -Height : Height;
-	bmih.biPlanes = 1;
-	bmih.biBitCount = BitDepth;
-	bmih.biCompression = 0;
-	bmih.biSizeImage = (ebmpDWORD) dTotalPixelBytes;
+static inline ebmpBYTE* PutWORD(ebmpBYTE* Out, ebmpWORD Value)
+{
+	Out[0] = (ebmpBYTE) Value;
+	Out[1] = (ebmpBYTE) (Value >> 8);
+	return Out + 2;
+}
+
+static inline ebmpBYTE* PutDWORD(ebmpBYTE* Out, ebmpDWORD Value)
+{
+	return PutWORD(PutWORD(Out, (ebmpWORD) Value), (ebmpWORD) (Value >> 16));
+}
 
-	if (XPelsPerMeter) bmih.biXPelsPerMeter = XPelsPerMeter;
-	else bmih.biXPelsPerMeter = DefaultXPelsPerMeter;
+static inline ebmpWORD GetWORD(const ebmpBYTE* In)
+{
+	return (ebmpWORD) (In[0] | (In[1] << 8));
+}
 
-	if (YPelsPerMeter) bmih.biYPelsPerMeter = YPelsPerMeter;
-	else bmih.biYPelsPerMeter = DefaultYPelsPerMeter;
+static inline ebmpDWORD GetDWORD(const ebmpBYTE* In)
+{
+	return GetWORD(In) | ((ebmpDWORD) GetWORD(In + 2) << 16);
+}
 
-	bmih.biClrUsed = 0;
-	bmih.biClrImportant = 0;
+// Bytes in one stored row, padded to a multiple of four. Worked out in
+// 64 bits so it cannot wrap even where size_t is 32 bits wide.
 
-	// indicates that we'll be using bit fields for 16-bit files
-	if (BitDepth == 16 ) bmih.biCompression = 3;
+static unsigned long long RowBytesFor(int Width, int BitDepth)
+{
+	return ((unsigned long long) Width * BitDepth + 31) / 32 * 4;
+}
 
-	if (IsBigEndian()) bmih.SwitchEndianess();
+static size_t BytesPerPixel(PixelFormat Format)
+{
+	if (Format == PixelFormat::Gray8) return 1;
+	if (Format == PixelFormat::RGB8 or Format == PixelFormat::BGR8) return 3;
+	return 4;
+}
+
+// Grain for items that each cost about WorkPerItem pixels of work: chunks
+// of roughly 64K pixels are big enough to be worth handing to a thread.
+
+static int GrainFor(long long WorkPerItem)
+{
+	if (WorkPerItem < 1) WorkPerItem = 1;
+	return (int) max<long long>(1, (1 << 16) / WorkPerItem);
+}
+
+// Encoded files are assembled in a staging buffer of about this size and
+// handed to the sink in as few pieces as possible; anything smaller goes
+// out in a single write.
+static const size_t EncodeStagingSize = 1 << 20;
+
+// The source, not this image, determines the width and height of the
+// file; RowOf(j) gives row j (0 is the top) as a one-row view.
 
-	fwrite( (char*) &(bmih.biSize), sizeof(ebmpDWORD), 1, fp );
-	fwrite( (char*) &(bmih.biWidth), sizeof(ebmpDWORD), 1, fp );
-	fwrite( (char*) &(bmih.biHeight), sizeof(ebmpDWORD), 1, fp );
-	fwrite( (char*) &(bmih.biPlanes), sizeof(ebmpWORD), 1, fp );
-	fwrite( (char*) &(bmih.biBitCount), sizeof(ebmpWORD), 1, fp );
-	fwrite( (char*) &(bmih.biCompression), sizeof(ebmpDWORD), 1, fp );
-	fwrite( (char*) &(bmih.biSizeImage), sizeof(ebmpDWORD), 1, fp );
-	fwrite( (char*) &(bmih.biXPelsPerMeter), sizeof(ebmpDWORD), 1, fp );
-	fwrite( (char*) &(bmih.biYPelsPerMeter), sizeof(ebmpDWORD), 1, fp );
-	fwrite( (char*) &(bmih.biClrUsed), sizeof(ebmpDWORD), 1, fp);
-	fwrite( (char*) &(bmih.biClrImportant), sizeof(ebmpDWORD), 1, fp);
-
-	// write the palette
+bool BMP::Encode(int Width, int Height, const RowSource& RowOf,
+				 const function<bool(const ebmpBYTE*, size_t)>& Sink)
+{
+	size_t RowBytes = (size_t) RowBytesFor(Width, BitDepth);
+	size_t PaletteBytes = 0;
 	if (BitDepth == 1 or BitDepth == 4 or BitDepth == 8) {
-		int NumberOfColors = IntPow(2,BitDepth);
+		PaletteBytes = (size_t) 4 << BitDepth;
 
 		// if there is no palette, create one
-		if (not Colors)	{
-			Colors = new RGBApixel[NumberOfColors];
+		if (not Colors) {
+			AllocateColors();
 			CreateStandardColorTable();
 		}
-
-		for (int n = 0; n < NumberOfColors; n++ ) {
-			fwrite((char*) &(Colors[n]), 4, 1, fp);
+	}
+	// room for the 16-bit masks
+	if (BitDepth == 16) PaletteBytes = 3*4;
+
+	size_t HeaderBytes = 14 + 40 + PaletteBytes;
+	size_t PixelBytes = (size_t) Height * RowBytes;
+
+	bool Compress = RLECompression and (BitDepth == 8 or BitDepth == 4);
+
+	// The staging buffer belongs to the thread, so writing one frame after
+	// another does not allocate and images keep no buffer while idle. It
+	// is trimmed back to Limit afterwards, so one large RLE file does not
+	// pin its memory. A write begun while the thread is already in one,
+	// from a stolen chunk of a parallel loop, gets a buffer of its own.
+	static thread_local ScratchVector<ebmpBYTE> Kept;
+	static thread_local bool KeptBusy = false;
+	size_t Limit = max(EncodeStagingSize, HeaderBytes + RowBytes);
+	ScratchVector<ebmpBYTE> Own;
+	struct Release {
+		bool Nested;
+		size_t Limit;
+		~Release()
+		{
+			if (Nested) return;
+			if (Kept.capacity() > Limit) ScratchVector<ebmpBYTE>().swap(Kept);
+			KeptBusy = false;
 		}
+	} Scope = { KeptBusy, Limit };
+	ScratchVector<ebmpBYTE>& Staging = Scope.Nested ? Own : Kept;
+	KeptBusy = true;
+
+	Staging.clear();
+	Staging.reserve(min(HeaderBytes + (Compress ? PixelBytes / 2 : PixelBytes), Limit));
+	Staging.resize(HeaderBytes);
+
+	// compressed pixel data is encoded straight after the headers, growing
+	// the buffer as it goes, and the sizes are filled in once it is known;
+	// they come first in the file, so it goes to the sink in one piece
+	if (Compress) {
+		EncodeRLE(Width, Height, RowOf, Staging);
+		PixelBytes = Staging.size() - HeaderBytes;
+	}
+
+	ebmpBYTE* Out = Staging.data();
+
+	// The size fields are 32 bits wide. Files of 4 GiB or more record
+	// them as 0, which readers accept for uncompressed data and which
+	// tells an RLE reader to decode until the end-of-bitmap marker.
+	auto SizeField = [](size_t Bytes) {
+		return Bytes > 0xFFFFFFFFu ? (ebmpDWORD) 0 : (ebmpDWORD) Bytes;
+	};
+
+	// the file header
+	Out = PutWORD(Out, 19778); // "BM"
+	Out = PutDWORD(Out, SizeField(HeaderBytes + PixelBytes));
+	Out = PutWORD(Out, 0);
+	Out = PutWORD(Out, 0);
+	Out = PutDWORD(Out, (ebmpDWORD) HeaderBytes);
+
+	// the info header; RLE bitmaps are always stored bottom-up, and 16-bit
+	// files are written with bit fields
+	ebmpDWORD Compression = 0;
+	if (BitDepth == 16) Compression = 3;
+	if (Compress) Compression = BitDepth == 8 ? 1 : 2;
+
+	Out = PutDWORD(Out, 40);
+	Out = PutDWORD(Out, (ebmpDWORD) (HorizontalFlip ? -Width : Width));
+	Out = PutDWORD(Out, (ebmpDWORD) (VerticalFlip and not Compress ? -Height : Height));
+	Out = PutWORD(Out, 1);
+	Out = PutWORD(Out, (ebmpWORD) BitDepth);
+	Out = PutDWORD(Out, Compression);
+	Out = PutDWORD(Out, SizeField(PixelBytes));
+	Out = PutDWORD(Out, (ebmpDWORD) (XPelsPerMeter ? XPelsPerMeter : DefaultXPelsPerMeter));
+	Out = PutDWORD(Out, (ebmpDWORD) (YPelsPerMeter ? YPelsPerMeter : DefaultYPelsPerMeter));
+	Out = PutDWORD(Out, 0);
+	Out = PutDWORD(Out, 0);
+
+	// the palette, or the 5-6-5 masks
+	if (BitDepth == 16) {
+		Out = PutDWORD(Out, 63488); // red, bits 1-5
+		Out = PutDWORD(Out, 2016);  // green, bits 6-11
+		Out = PutDWORD(Out, 31);    // blue, bits 12-16
+	}
+	else if (PaletteBytes) {
+		memcpy(Out, Colors, PaletteBytes);
 	}
 
-	// write the pixels
-	int i, j, row, col;
-	if (BitDepth != 16)	{
-		ebmpBYTE* Buffer;
-		int BufferSize = (int) ( (Width * BitDepth) / 8.0 );
-		while (8 * BufferSize < Width * BitDepth) BufferSize++;
-		while (BufferSize % 4) BufferSize++;
-
-		Buffer = new ebmpBYTE [BufferSize];
-		for (j = 0; j < BufferSize; j++) Buffer[j] = 0;
-
-		j=Height - 1;
-
-		while (j > -1) {
-			// If the image has a negative height, then the pixel buffer is 
-			// stored top to bottom rather than bottom to top.
-			row = VerticalFlip ? Height -1 -j : j;
+	if (Compress) return Sink(Staging.data(), Staging.size());
 
-			bool Success = false;
-			if (BitDepth == 32) Success = Write32bitRow( Buffer, BufferSize, row );
-			if (BitDepth == 24) Success = Write24bitRow( Buffer, BufferSize, row );
-			if (BitDepth == 8 ) Success = Write8bitRow( Buffer, BufferSize, row );
-			if (BitDepth == 4 ) Success = Write4bitRow( Buffer, BufferSize, row );
-			if (BitDepth == 1 ) Success = Write1bitRow( Buffer, BufferSize, row );
-			if (Success) {
-				int BytesWritten = (int) fwrite((char*) Buffer, 1, BufferSize, fp);
-				if ( BytesWritten != BufferSize ) Success = false;
-			}
-			if (!Success) {
-				if (g_exceptions) {
-					delete [] Buffer;
-					throw runtime_error("EasyBMP::WriteToFile: could not write proper amount of data.");
-				}
-				j = -1;
-			}
-			j--;
+	// the pixels, as many rows at a time as fit in the staging buffer;
+	// every row of a batch has its own slot, so the rows are encoded in
+	// parallel. resize() zero-fills the slots, which takes care of the
+	// padding.
+	for (int Done = 0; Done < Height; ) {
+		if (Staging.size() + RowBytes > Limit) {
+			if (not Sink(Staging.data(), Staging.size())) return false;
+			Staging.clear();
 		}
 
-		delete [] Buffer;
+		int Batch = (int) min<size_t>(Height - Done, (Limit - Staging.size()) / RowBytes);
+		size_t Used = Staging.size();
+		Staging.resize(Used + Batch * RowBytes);
+		ebmpBYTE* First = Staging.data() + Used;
+
+		ParallelFor(0, Batch, GrainFor(BitDepth <= 8 ? (long long) Width * 16 : Width), [&](int Begin, int End) {
+			for (int k = Begin; k < End; k++) {
+				// If the image has a negative height, then the pixel buffer
+				// is stored top to bottom rather than bottom to top.
+				int j = Height - 1 - (Done + k);
+				int row = VerticalFlip ? Height -1 -j : j;
+				ebmpBYTE* Row = First + k * RowBytes;
+
+				if (BitDepth == 32) Write32bitRow(RowOf(row), Row, RowBytes, 0);
+				if (BitDepth == 24) Write24bitRow(RowOf(row), Row, RowBytes, 0);
+				if (BitDepth == 16) Write16bitRow(RowOf(row), Row, RowBytes, 0);
+				if (BitDepth == 8 ) Write8bitRow(RowOf(row), Row, RowBytes, 0);
+				if (BitDepth == 4 ) Write4bitRow(RowOf(row), Row, RowBytes, 0);
+				if (BitDepth == 1 ) Write1bitRow(RowOf(row), Row, RowBytes, 0);
+			}
+		});
+		Done += Batch;
 	}
 
-	if (BitDepth == 16) {
-		// write the bit masks
-
-		ebmpWORD BlueMask = 31;    // bits 12-16
-		ebmpWORD GreenMask = 2016; // bits 6-11
-		ebmpWORD RedMask = 63488;  // bits 1-5
-		ebmpWORD ZeroWORD;
-
-		if (IsBigEndian()) RedMask = FlipWORD(RedMask);
-		fwrite( (char*) &RedMask, 2, 1, fp );
-		fwrite( (char*) &ZeroWORD, 2, 1, fp );
-
-		if (IsBigEndian()) GreenMask = FlipWORD(GreenMask);
-		fwrite( (char*) &GreenMask, 2, 1, fp );
-		fwrite( (char*) &ZeroWORD, 2, 1, fp );
-
-		if (IsBigEndian()) BlueMask = FlipWORD(BlueMask);
-		fwrite( (char*) &BlueMask, 2, 1, fp );
-		fwrite( (char*) &ZeroWORD, 2, 1, fp );
-
-		int DataBytes = Width * 2;
-		int PaddingBytes = (4 - DataBytes % 4) % 4;
-
-		// write the actual pixels
-		for (j = Height - 1; j >= 0 ; j--) {
-			// write all row pixel data
-			i = 0;
-			int WriteNumber = 0;
-			while (WriteNumber < DataBytes) {
-				ebmpWORD TempWORD;
-
-				// If the image has a negative height, then the pixel buffer is 
-				// stored top to bottom rather than bottom to top.
-				row = VerticalFlip ? Height -1 -j : j; 
-				col = HorizontalFlip ? Width -1 -i : i;
-
-				ebmpWORD RedWORD = (ebmpWORD) ((Pixels[col][row]).Red / 8);
-				ebmpWORD GreenWORD = (ebmpWORD) ((Pixels[col][row]).Green / 4);
-				ebmpWORD BlueWORD = (ebmpWORD) ((Pixels[col][row]).Blue / 8);
-
-				TempWORD = (RedWORD << 11) + (GreenWORD << 5) + BlueWORD;
-				if (IsBigEndian()) TempWORD = FlipWORD( TempWORD );
-
-				fwrite( (char*) &TempWORD , 2, 1, fp);
-				WriteNumber += 2;
-				i++;
-			}
-			// write any necessary row padding
-			WriteNumber = 0;
-			while (WriteNumber < PaddingBytes) {
-				ebmpBYTE TempBYTE;
-				fwrite( (char*) &TempBYTE , 1, 1, fp);
-				WriteNumber++;
-			}
-		}
+	return Sink(Staging.data(), Staging.size());
+}
 
-	}
+// Row j of Region as a one-row view, for Encode.
 
-	fclose(fp);
-	return true;
+static function<BMPView(int)> RowsOf(const BMPView& Region)
+{
+	return [Region](int j) {
+		return BMPView(&Region(0, j), Region.Width, 1, Region.ColumnStride, Region.RowStride);
+	};
 }
 
-bool BMP::ReadFromStream(istream& in)
+// The rows of the image itself: views straight into the pixels while
+// they are one block, otherwise gathered into a per-thread row that stays
+// valid until the same thread asks for another row. Reading them never
+// makes the image copy shared pixels.
+
+BMP::RowSource BMP::Rows(void) const
 {
-	// read the file header
+	if (Copies.empty()) return RowsOf(BMPView(Data, Width, Height, Height, 1));
+	return [this](int j) {
+		static thread_local ScratchVector<RGBApixel> ScratchRow;
+		ScratchRow.resize(Width);
+		for (int i = 0; i < Width; i++) ScratchRow[i] = Pixels[i][j];
+		return BMPView(ScratchRow.data(), Width, 1, 1, 0);
+	};
+}
 
-	BMFH bmfh;
-	bool NotCorrupted = true;
+bool BMP::WriteToFile(const string& FileName, const BMPView& Region)
+{
+	return bool(EncodeToFile(FileName, Region.Width, Region.Height, RowsOf(Region)));
+}
+
+bool BMP::WriteToFile(const string& FileName, const PixelBuffer& Source)
+{
+	if (not CheckPixelBuffer(Source, "EasyBMP::WriteToFile")) return false;
+	return bool(EncodeToFile(FileName, Source.Width, Source.Height, [this, &Source](int j) {
+		return PixelBufferRow(Source, j);
+	}));
+}
 
-	NotCorrupted &= SafeFread((char*) &(bmfh.bfType), sizeof(ebmpWORD), 1, in);
+bool BMP::WriteToStream(ostream& out)
+{
+	return bool(EncodeToStream(out, Width, Height, Rows()));
+}
 
-	bool IsBitmap = false;
+bool BMP::WriteToStream(ostream& out, const BMPView& Region)
+{
+	return bool(EncodeToStream(out, Region.Width, Region.Height, RowsOf(Region)));
+}
 
-	if (IsBigEndian()     and bmfh.bfType == 16973) IsBitmap = true;
-	if (not IsBigEndian() and bmfh.bfType == 19778) IsBitmap = true;
+bool BMP::WriteToStream(ostream& out, const PixelBuffer& Source)
+{
+	if (not CheckPixelBuffer(Source, "EasyBMP::WriteToStream")) return false;
+	return bool(EncodeToStream(out, Source.Width, Source.Height, [this, &Source](int j) {
+		return PixelBufferRow(Source, j);
+	}));
+}
 
-	if (!IsBitmap) {
+bool BMP::CheckPixelBuffer(const PixelBuffer& Source, const string& Caller)
+{
+	if (Source.Width > 0 and Source.Height > 0 and not Source.Data) {
 		if (g_exceptions) {
-			throw runtime_error("EasyBMP::ReadFromStream: not a Windows BMP file");
+			throw invalid_argument(Caller + ": the pixel buffer has no data.");
 		}
 		return false;
 	}
+	if (Source.Width > 0 and (size_t) abs(Source.Stride) < BytesPerPixel(Source.Format) * Source.Width) {
+		if (g_exceptions) {
+			throw invalid_argument(Caller + ": a stride of " + to_string(Source.Stride) +
+								   " bytes is too small for " + to_string(Source.Width) + " pixels.");
+		}
+		return false;
+	}
+	return true;
+}
 
-	NotCorrupted &= SafeFread((char*) &(bmfh.bfSize), sizeof(ebmpDWORD), 1, in);
-	NotCorrupted &= SafeFread((char*) &(bmfh.bfReserved1), sizeof(ebmpWORD), 1, in);
-	NotCorrupted &= SafeFread((char*) &(bmfh.bfReserved2), sizeof(ebmpWORD), 1, in);
-	NotCorrupted &= SafeFread((char*) &(bmfh.bfOffBits), sizeof(ebmpDWORD), 1, in);
-
-	if (IsBigEndian()) bmfh.SwitchEndianess();
+// BGRA8 rows already are RGBApixels and are viewed in place; other
+// layouts are unpacked into a per-thread row, which stays valid until
+// the same thread asks for another row.
 
-	// read the info header
+BMPView BMP::PixelBufferRow(const PixelBuffer& Source, int j)
+{
+	const ebmpBYTE* In = (const ebmpBYTE*) Source.Data + j * Source.Stride;
+	if (Source.Format == PixelFormat::BGRA8) {
+		return BMPView((RGBApixel*) In, Source.Width, 1, 1, 0);
+	}
+
+	static thread_local ScratchVector<RGBApixel> ScratchRow;
+	ScratchRow.resize(Source.Width);
+	RGBApixel* Out = ScratchRow.data();
+	for (int i = 0; i < Source.Width; i++) {
+		switch (Source.Format) {
+		case PixelFormat::RGB8:
+			Out[i].Red = In[3 * i]; Out[i].Green = In[3 * i + 1]; Out[i].Blue = In[3 * i + 2]; Out[i].Alpha = 0;
+			break;
+		case PixelFormat::BGR8:
+			Out[i].Blue = In[3 * i]; Out[i].Green = In[3 * i + 1]; Out[i].Red = In[3 * i + 2]; Out[i].Alpha = 0;
+			break;
+		case PixelFormat::RGBA8:
+			Out[i].Red = In[4 * i]; Out[i].Green = In[4 * i + 1]; Out[i].Blue = In[4 * i + 2]; Out[i].Alpha = In[4 * i + 3];
+			break;
+		case PixelFormat::Gray8:
+			Out[i].Red = Out[i].Green = Out[i].Blue = In[i]; Out[i].Alpha = 0;
+			break;
+		case PixelFormat::BGRA8:
+			break;
+		}
+	}
+	return BMPView(Out, Source.Width, 1, 1, 0);
+}
 
-	BMIH bmih;
+BMPStatus BMP::EncodeToFile(const string& FileName, int Width, int Height, const RowSource& RowOf)
+{
+	if (Width <= 0 or Height <= 0) {
+		if (g_exceptions) {
+			throw invalid_argument("EasyBMP::WriteToFile: cannot write an empty region.");
+		}
+		return { BMPError::InvalidArgument, 0 };
+	}
+
+	if (not EasyBMPcheckDataSize()) {
+		if (g_exceptions) {
+			throw runtime_error(string("EasyBMP::WriteToFile: data types are wrong size! ") +
+								"You may need to mess with EasyBMP_DataTypes.h to fix these errors, and then recompile. " +
+								"All 32-bit and 64-bit machines should be supported, however.");
+		}
+		return { BMPError::InvalidArgument, 0 };
+	}
+
+	FILE* fp = fopen(FileName.c_str(), "wb");
+	if (not fp) {
+		if (g_exceptions) {
+			throw runtime_error("EasyBMP::WriteToFile: cannot open file " + FileName + " for output.");
+		}
+		return { BMPError::CannotOpen, 0 };
+	}
 
-	NotCorrupted &= SafeFread((char*) &(bmih.biSize), sizeof(ebmpDWORD), 1, in);
-	NotCorrupted &= SafeFread((char*) &(bmih.biWidth), sizeof(ebmpDWORD), 1, in);
-	NotCorrupted &= SafeFread((char*) &(bmih.biHeight), sizeof(ebmpDWORD), 1, in);
-	NotCorrupted &= SafeFread((char*) &(bmih.biPlanes), sizeof(ebmpWORD), 1, in);
-	NotCorrupted &= SafeFread((char*) &(bmih.biBitCount), sizeof(ebmpWORD), 1, in);
+	size_t Written = 0;
+	bool Success = Encode(Width, Height, RowOf, [fp, &Written](const ebmpBYTE* Data, size_t Size) {
+		size_t Count = fwrite(Data, 1, Size, fp);
+		Written += Count;
+		return Count == Size;
+	});
+	if (fclose(fp) != 0) Success = false;
 
-	NotCorrupted &= SafeFread((char*) &(bmih.biCompression), sizeof(ebmpDWORD), 1, in);
-	NotCorrupted &= SafeFread((char*) &(bmih.biSizeImage), sizeof(ebmpDWORD), 1, in);
-	NotCorrupted &= SafeFread((char*) &(bmih.biXPelsPerMeter), sizeof(ebmpDWORD), 1, in);
-	NotCorrupted &= SafeFread((char*) &(bmih.biYPelsPerMeter), sizeof(ebmpDWORD), 1, in);
-	NotCorrupted &= SafeFread((char*) &(bmih.biClrUsed), sizeof(ebmpDWORD), 1, in);
-	NotCorrupted &= SafeFread((char*) &(bmih.biClrImportant), sizeof(ebmpDWORD), 1, in);
+	if (not Success) {
+		if (g_exceptions) {
+			throw runtime_error("EasyBMP::WriteToFile: could not write proper amount of data.");
+		}
+		return { BMPError::WriteFailed, Written };
+	}
+	return { BMPError::None, Written };
+}
 
-	if (IsBigEndian()) bmih.SwitchEndianess();
+BMPStatus BMP::EncodeToStream(ostream& out, int Width, int Height, const RowSource& RowOf)
+{
+	if (Width <= 0 or Height <= 0) {
+		if (g_exceptions) {
+			throw invalid_argument("EasyBMP::WriteToStream: cannot write an empty region.");
+		}
+		return { BMPError::InvalidArgument, 0 };
+	}
+
+	if (not EasyBMPcheckDataSize()) {
+		if (g_exceptions) {
+			throw runtime_error(string("EasyBMP::WriteToStream: data types are wrong size! ") +
+								"You may need to mess with EasyBMP_DataTypes.h to fix these errors, and then recompile. " +
+								"All 32-bit and 64-bit machines should be supported, however.");
+		}
+		return { BMPError::InvalidArgument, 0 };
+	}
+
+	// Encode stages the file in large chunks, so the stream sees a handful
+	// of big writes rather than one per row
+	size_t Written = 0;
+	bool Success = Encode(Width, Height, RowOf, [&out, &Written](const ebmpBYTE* Data, size_t Size) {
+		if (not out.write((const char*) Data, (streamsize) Size)) return false;
+		Written += Size;
+		return true;
+	});
+
+	if (not Success) {
+		if (g_exceptions) {
+			throw runtime_error("EasyBMP::WriteToStream: could not write proper amount of data.");
+		}
+		return { BMPError::WriteFailed, Written };
+	}
+	return { BMPError::None, Written };
+}
+
+// The Try functions run with exceptions off for the calling thread and
+// report through the status alone.
+
+BMPStatus BMP::TryWriteToFile(const string& FileName)
+{
+	ExceptionScope Quiet(false);
+	return EncodeToFile(FileName, Width, Height, Rows());
+}
+
+BMPStatus BMP::TryWriteToStream(ostream& out)
+{
+	ExceptionScope Quiet(false);
+	return EncodeToStream(out, Width, Height, Rows());
+}
+
+// Skips Count bytes of a stream with one seek, or by discarding them when
+// the stream cannot seek.
+
+static bool SkipBytes(istream& in, streamoff Count)
+{
+	if (Count <= 0) return true;
+	if (in.seekg(Count, ios::cur)) return true;
+	in.clear();
+	in.ignore(Count);
+	return in.gcount() == Count;
+}
+
+// Turns 32-bit pixels described by red, green, blue and alpha masks into
+// RGBApixels. Masks that each cover one whole byte (BGRA, BGRX, RGBA, ...)
+// are a plain byte permutation: a straight copy when it is the identity,
+// otherwise one byte shuffle, or shifts and masks on SSE2 alone. Anything
+// else goes through mask and shift.
+// Without an alpha mask, Alpha receives the one byte no mask uses, as it
+// does for uncompressed 32-bit files, or 0 when there is no such byte.
+
+class BitFieldDecoder {
+public:
+	BitFieldDecoder(const ebmpDWORD Masks[4])
+	{
+		// output byte order is Blue, Green, Red, Alpha
+		const ebmpDWORD Ordered[4] = { Masks[2], Masks[1], Masks[0], Masks[3] };
+
+		ByteAligned = true;
+		int Used = 0;
+		for (int c = 0; c < 4; c++) {
+			Select[c] = -1;
+			for (int k = 0; k < 4; k++) {
+				if (Ordered[c] == (0xFFu << (8 * k))) Select[c] = k;
+			}
+			if (Select[c] >= 0) Used |= 1 << Select[c];
+			else if (Ordered[c] != 0 or c != 3) ByteAligned = false;
+		}
+		if (ByteAligned and Select[3] < 0) {
+			for (int k = 0; k < 4; k++) {
+				if (Used == (15 & ~(1 << k))) Select[3] = k;
+			}
+		}
+		Identity = Select[0] == 0 and Select[1] == 1 and Select[2] == 2 and Select[3] == 3;
+
+		for (int c = 0; c < 4; c++) {
+			ebmpDWORD Mask = Ordered[c];
+			Shift[c] = 0;
+			Bits[c] = 0;
+			if (not Mask) continue;
+			while (not (Mask & 1)) { Mask >>= 1; Shift[c]++; }
+			while (Mask & 1) { Mask >>= 1; Bits[c]++; }
+			// keep only the top 8 bits of wide fields
+			if (Bits[c] > 8) { Shift[c] += Bits[c] - 8; Bits[c] = 8; }
+		}
+	}
+
+	void Decode(const ebmpBYTE* Source, RGBApixel* Target, int Count) const
+	{
+		if (Identity) {
+			memcpy(Target, Source, 4 * (size_t) Count);
+			return;
+		}
+
+		ebmpBYTE* Out = (ebmpBYTE*) Target;
+		int i = 0;
+		if (ByteAligned) {
+#ifdef __SSSE3__
+			char Control[16];
+			for (int n = 0; n < 16; n++) {
+				int k = Select[n % 4];
+				Control[n] = (char) (k < 0 ? 0x80 : (n / 4) * 4 + k);
+			}
+			__m128i vControl = _mm_loadu_si128((const __m128i*) Control);
+			for (; i + 4 <= Count; i += 4) {
+				__m128i v = _mm_loadu_si128((const __m128i*) (Source + 4 * i));
+				_mm_storeu_si128((__m128i*) (Out + 4 * i), _mm_shuffle_epi8(v, vControl));
+			}
+#elif defined(EasyBMP_SSE2)
+			// without a byte shuffle, move each byte into place within its
+			// 32-bit lane: shift it down or up to its channel and mask it
+			__m128i vDown[4], vUp[4], vKeep[4];
+			for (int c = 0; c < 4; c++) {
+				int k = Select[c];
+				vDown[c] = _mm_cvtsi32_si128(k > c ? 8 * (k - c) : 0);
+				vUp[c] = _mm_cvtsi32_si128(k < c ? 8 * (c - k) : 0);
+				vKeep[c] = _mm_set1_epi32(k < 0 ? 0 : (int) (0xFFu << (8 * c)));
+			}
+			for (; i + 4 <= Count; i += 4) {
+				__m128i v = _mm_loadu_si128((const __m128i*) (Source + 4 * i));
+				__m128i r = _mm_setzero_si128();
+				for (int c = 0; c < 4; c++) {
+					__m128i Byte = _mm_sll_epi32(_mm_srl_epi32(v, vDown[c]), vUp[c]);
+					r = _mm_or_si128(r, _mm_and_si128(Byte, vKeep[c]));
+				}
+				_mm_storeu_si128((__m128i*) (Out + 4 * i), r);
+			}
+#endif
+			for (; i < Count; i++) {
+				for (int c = 0; c < 4; c++) {
+					Out[4 * i + c] = Select[c] < 0 ? 0 : Source[4 * i + Select[c]];
+				}
+			}
+			return;
+		}
+
+		for (; i < Count; i++) {
+			const ebmpBYTE* p = Source + 4 * i;
+			ebmpDWORD Value = p[0] | (p[1] << 8) | (p[2] << 16) | ((ebmpDWORD) p[3] << 24);
+			for (int c = 0; c < 4; c++) {
+				Out[4 * i + c] = Scale(Value, c);
+			}
+		}
+	}
+
+private:
+	ebmpBYTE Scale(ebmpDWORD Value, int c) const
+	{
+		if (not Bits[c]) return 0;
+		ebmpDWORD Max = (1u << Bits[c]) - 1;
+		ebmpDWORD Field = (Value >> Shift[c]) & Max;
+		return (ebmpBYTE) ((Field * 255 + Max / 2) / Max);
+	}
+
+	int Select[4];
+	int Shift[4];
+	int Bits[4];
+	bool ByteAligned;
+	bool Identity;
+};
+
+// Where ReadFromStream and ReadFromBuffer get their bytes. Take() hands
+// out the next Count bytes as one block: a pointer straight into the
+// caller's memory for a buffer, or into a reused scratch block for a
+// stream. It returns null, having used up what was left, when the source
+// runs out first. Blocks are only valid until the next call.
+
+class BMP::ByteSource {
+public:
+	ByteSource(istream& in) : Stream(&in) {}
+	ByteSource(const ebmpBYTE* Data, size_t Size) : Data(Data), Size(Size) {}
+
+	// Stream reads of header-sized pieces land in Small, so rejecting a
+	// bad header never touches the heap.
+	const ebmpBYTE* Take(size_t Count)
+	{
+		if (Stream) {
+			ebmpBYTE* Into = Small;
+			if (Count > sizeof(Small)) {
+				if (Scratch.size() < Count) Scratch.resize(Count);
+				Into = Scratch.data();
+			}
+			Stream->read((char*) Into, (streamsize) Count);
+			Position += (size_t) Stream->gcount();
+			return Stream->gcount() == (streamsize) Count ? Into : nullptr;
+		}
+		if (Count > Size - Position) {
+			Position = Size;
+			return nullptr;
+		}
+		Position += Count;
+		return Data + Position - Count;
+	}
+
+	// Like Take(), but settles for fewer than Max bytes: whatever one
+	// 4 KiB read of a stream returns, or the rest of a buffer. Got is 0
+	// once the source is exhausted.
+	const ebmpBYTE* TakeSome(size_t Max, size_t& Got)
+	{
+		if (Stream) return TakeUpTo(min<size_t>(Max, 4096), Got);
+		Got = min(Max, Size - Position);
+		Position += Got;
+		return Data + Position - Got;
+	}
+
+	// Like TakeSome(), but without the 4 KiB cap: a stream read stops
+	// short only at the end of the data.
+	const ebmpBYTE* TakeUpTo(size_t Max, size_t& Got)
+	{
+		if (Stream) {
+			if (Scratch.size() < Max) Scratch.resize(Max);
+			Stream->read((char*) Scratch.data(), (streamsize) Max);
+			Got = (size_t) Stream->gcount();
+			Position += Got;
+			return Scratch.data();
+		}
+		Got = min(Max, Size - Position);
+		Position += Got;
+		return Data + Position - Got;
+	}
+
+	bool Skip(size_t Count)
+	{
+		if (Stream) {
+			if (not SkipBytes(*Stream, (streamoff) Count)) return false;
+			Position += Count;
+			return true;
+		}
+		if (Count > Size - Position) {
+			Position = Size;
+			return false;
+		}
+		Position += Count;
+		return true;
+	}
+
+	// bytes consumed so far
+	size_t Offset(void) const { return Position; }
+
+	// Bytes left in the source, if that can be told without consuming
+	// them: always for buffers, and for streams that can seek.
+	bool Remaining(size_t& Count)
+	{
+		if (not Stream) {
+			Count = Size - Position;
+			return true;
+		}
+		if (Stream->eof()) {
+			Count = 0;
+			return true;
+		}
+		streampos Here = Stream->tellg();
+		if (Here == streampos(-1) or not Stream->seekg(0, ios::end)) {
+			Stream->clear();
+			return false;
+		}
+		streampos End = Stream->tellg();
+		Stream->seekg(Here);
+		if (End == streampos(-1)) return false;
+		Count = End > Here ? (size_t) (End - Here) : 0;
+		return true;
+	}
+
+	// Records the first failure and where it happened; always false, so
+	// error paths can end with "return Source.Fail(...)".
+	bool Fail(BMPError Error)
+	{
+		if (Failure.Error == BMPError::None) Failure = { Error, Position };
+		return false;
+	}
+
+	// on success, Offset is the number of bytes consumed
+	BMPStatus Status(void) const
+	{
+		if (Failure.Error != BMPError::None) return Failure;
+		return { BMPError::None, Position };
+	}
+
+private:
+	istream* Stream = nullptr;
+	const ebmpBYTE* Data = nullptr;
+	size_t Size = 0;
+	// bytes consumed so far, for streams as well as buffers
+	size_t Position = 0;
+	BMPStatus Failure = { BMPError::None, 0 };
+	ebmpBYTE Small[1024];
+	ScratchVector<ebmpBYTE> Scratch;
+};
+
+// What the headers of a file say about its pixel data. The palette
+// always has 2^BitDepth entries for files of 8 bits or less.
+
+struct BMP::FileLayout {
+	int Width;
+	int Height;
+	bool TopDown;
+	int BitDepth;
+	ebmpDWORD Compression;
+	ebmpDWORD CompressedSize;
+	ebmpDWORD Masks[4];
+	int XPelsPerMeter;
+	int YPelsPerMeter;
+	RGBApixel Palette[256];
+};
+
+bool BMP::ReadFromStream(istream& in)
+{
+	ByteSource Source(in);
+	return ReadFromSource(Source);
+}
+
+bool BMP::ReadFromSource(ByteSource& Source)
+{
+	FileLayout Layout;
+	bool HeadersRead = false;
+	try {
+		HeadersRead = ReadLayout(Source, Layout);
+	}
+	catch (const exception&) {
+		SetSize(1, 1);
+		SetBitDepth(1);
+		throw;
+	}
+	if (not HeadersRead) {
+		SetSize(1, 1);
+		SetBitDepth(1);
+		return false;
+	}
+	return ReadPixels(Source, Layout);
+}
+
+// Sets up the image for a file whose headers have been read and decodes
+// its pixels into it.
+
+bool BMP::ReadPixels(ByteSource& Source, const FileLayout& Layout)
+{
+	XPelsPerMeter = Layout.XPelsPerMeter;
+	YPelsPerMeter = Layout.YPelsPerMeter;
+
+	// Reading one same-sized image after another reuses the color table
+	// and the pixel block. Every row is decoded over, so the pixels are
+	// not cleared first; only rows a failed read never reached are.
+	if (BitDepth != Layout.BitDepth or (Layout.BitDepth <= 8 and not Colors)) {
+		SetBitDepth(Layout.BitDepth);
+	}
+	if (Colors) memcpy(Colors, Layout.Palette, 4 * (size_t) TellNumberOfColors());
+	AllocatePixels(Layout.Width, Layout.Height);
+	HorizontalFlip = false;
+	VerticalFlip = Layout.TopDown;
+
+	RLECompression = Layout.Compression == 1 or Layout.Compression == 2;
+
+	// rows may be delivered from several threads at once
+	atomic<int> RowsRead{0};
+	auto ClearUnread = [&]() {
+		RGBApixel WHITE;
+		WHITE.Red = 255;
+		WHITE.Green = 255;
+		WHITE.Blue = 255;
+		WHITE.Alpha = 0;
+		// rows arrive in file order: from the top for top-down files,
+		// otherwise from the bottom
+		int Read = RowsRead;
+		int First = Layout.TopDown ? Read : 0;
+		for (int j = First; j < First + Height - Read; j++) {
+			for (int i = 0; i < Width; i++) Pixels[i][j] = WHITE;
+		}
+	};
+
+	bool Success = false;
+	try {
+		Success = DecodeRows(Source, Layout, [this, &RowsRead](int Row, const RGBApixel* Decoded) {
+			for (int i = 0; i < Width; i++) {
+				Pixels[HorizontalFlip ? Width -1 -i : i][Row] = Decoded[i];
+			}
+			RowsRead++;
+		});
+	}
+	catch (const exception&) {
+		ClearUnread();
+		throw;
+	}
+	if (not Success) ClearUnread();
+	return Success;
+}
+
+// Reads the headers, color table and masks, and leaves Source at the
+// start of the pixel data.
+
+bool BMP::ReadLayout(ByteSource& Source, FileLayout& Layout)
+{
+	// read the file header
+
+	BMFH bmfh;
+	const ebmpBYTE* Header = Source.Take(2);
+
+	if (not Header or GetWORD(Header) != 19778) {
+		if (g_exceptions) {
+			throw runtime_error("EasyBMP::ReadFromStream: not a Windows BMP file");
+		}
+		return Source.Fail(Header ? BMPError::NotBMP : BMPError::Truncated);
+	}
+
+	// the rest of the file header and the info header, both little-endian
+
+	BMIH bmih;
+	Header = Source.Take(12 + 40);
+	bool NotCorrupted = Header != nullptr;
+
+	if (NotCorrupted) {
+		bmfh.bfSize      = GetDWORD(Header);
+		bmfh.bfReserved1 = GetWORD(Header + 4);
+		bmfh.bfReserved2 = GetWORD(Header + 6);
+		bmfh.bfOffBits   = GetDWORD(Header + 8);
+		Header += 12;
+
+		bmih.biSize          = GetDWORD(Header);
+		bmih.biWidth         = GetDWORD(Header + 4);
+		bmih.biHeight        = GetDWORD(Header + 8);
+		bmih.biPlanes        = GetWORD(Header + 12);
+		bmih.biBitCount      = GetWORD(Header + 14);
+		bmih.biCompression   = GetDWORD(Header + 16);
+		bmih.biSizeImage     = GetDWORD(Header + 20);
+		bmih.biXPelsPerMeter = GetDWORD(Header + 24);
+		bmih.biYPelsPerMeter = GetDWORD(Header + 28);
+		bmih.biClrUsed       = GetDWORD(Header + 32);
+		bmih.biClrImportant  = GetDWORD(Header + 36);
+	}
 
 	// a safety catch: if any of the header information didn't read properly, abort
 	// future idea: check to see if at least most is self-consistent
 
 	if (not NotCorrupted) {
-		SetSize(1, 1);
-		SetBitDepth(1);
 		if (g_exceptions) {
 			throw runtime_error("EasyBMP::ReadFromStream: file is corrupted");
 		}
-		return false;
+		return Source.Fail(BMPError::Truncated);
 	}
 
-	XPelsPerMeter = bmih.biXPelsPerMeter;
-	YPelsPerMeter = bmih.biYPelsPerMeter;
+	// the 12-byte OS/2 core header and the 16/64-byte OS/2 2.x headers
+	// lay out their fields differently
 
-	// if bmih.biCompression 1 or 2, then the file is RLE compressed
+	if (bmih.biSize < 40) {
+		if (g_exceptions) {
+			throw runtime_error("EasyBMP::ReadFromStream: unsupported " + to_string(bmih.biSize) +
+								"-byte info header. The file may be an old OS2 bitmap.");
+		}
+		return Source.Fail(BMPError::UnsupportedHeader);
+	}
 
-	if (bmih.biCompression == 1 or bmih.biCompression == 2) {
-		SetSize(1, 1);
-		SetBitDepth(1);
+	Layout.XPelsPerMeter = (int) bmih.biXPelsPerMeter;
+	Layout.YPelsPerMeter = (int) bmih.biYPelsPerMeter;
+
+	// if bmih.biCompression 1 or 2, then the file is RLE compressed,
+	// which is only defined for 8-bit (RLE8) and 4-bit (RLE4) files
+
+	if ((bmih.biCompression == 1 and bmih.biBitCount != 8) or
+		(bmih.biCompression == 2 and bmih.biBitCount != 4))
+	{
 		if (g_exceptions) {
-			throw runtime_error("EasyBMP::ReadFromStream: file is (RLE) compressed. "
-								"EasyBMP does not support compression.");
+			throw runtime_error("EasyBMP::ReadFromStream: RLE" + to_string(bmih.biCompression == 1 ? 8 : 4) +
+								" compression used in a " + to_string(bmih.biBitCount) + "-bit file.");
 		}
-		return false;
+		return Source.Fail(BMPError::UnsupportedFormat);
 	}
 
 	// if bmih.biCompression > 3, then something strange is going on
-	// it's probably an OS2 bitmap file.
+	// it's probably an OS2 bitmap file. (6 is bit fields with alpha.)
 
-	if (bmih.biCompression > 3) {
-		SetSize(1, 1);
-		SetBitDepth(1);
+	if (bmih.biCompression > 3 and bmih.biCompression != 6) {
 		if (g_exceptions) {
 			throw runtime_error("EasyBMP::ReadFromStream: file is an unsupported format."
 								"(bmih.biCompression = " + to_string(bmih.biCompression) + "). "
 								"The file may be an old OS2 bitmap or corrupted.");
 		}
-		return false;
+		return Source.Fail(BMPError::UnsupportedFormat);
 	}
 
-	if (bmih.biCompression == 3 and bmih.biBitCount != 16) {
-		SetSize(1, 1);
-		SetBitDepth(1);
+	if ((bmih.biCompression == 3 or bmih.biCompression == 6) and
+		bmih.biBitCount != 16 and bmih.biBitCount != 32)
+	{
 		if (g_exceptions) {
-			throw runtime_error("EasyBMP::ReadFromStream: file uses bit fields and is not a 16-bit file. This is not supported.");
+			throw runtime_error("EasyBMP::ReadFromStream: file uses bit fields and is not a 16-bit or 32-bit file. This is not supported.");
 		}
-		return false;
+		return Source.Fail(BMPError::UnsupportedFormat);
 	}
+	Layout.Compression = bmih.biCompression;
+	Layout.CompressedSize = bmih.biSizeImage;
 
-	// set the bit depth
+	// the bit depth
 
-	int TempBitDepth = (int) bmih.biBitCount;
-	if (TempBitDepth != 1  and TempBitDepth != 4  and TempBitDepth != 8 and
-		TempBitDepth != 16 and TempBitDepth != 24 and TempBitDepth != 32)
+	int BitDepth = (int) bmih.biBitCount;
+	if (BitDepth != 1  and BitDepth != 4  and BitDepth != 8 and
+		BitDepth != 16 and BitDepth != 24 and BitDepth != 32)
 	{
-		SetSize(1, 1);
-		SetBitDepth(1);
 		if (g_exceptions) {
 			throw runtime_error("EasyBMP::ReadFromStream: unrecognized bit depth.");
 		}
-		return false;
+		return Source.Fail(BMPError::UnsupportedFormat);
 	}
-	SetBitDepth((int) bmih.biBitCount);
+	Layout.BitDepth = BitDepth;
 
-	// set the size
+	// the size; a negative height means the rows are stored top to bottom
 
 	if ((int) bmih.biWidth <= 0) {
 		// Only negative height currently supported
-		SetSize(1, 1);
-		SetBitDepth(1);
 		if (g_exceptions) {
 			throw runtime_error("EasyBMP::ReadFromStream: negative width parameter.");
 		}
-		return false;
+		return Source.Fail(BMPError::BadDimensions);
+	}
+	if ((int) bmih.biHeight == 0 or (int) bmih.biHeight == numeric_limits<int>::min()) {
+		if (g_exceptions) {
+			throw runtime_error("EasyBMP::ReadFromStream: invalid height parameter.");
+		}
+		return Source.Fail(BMPError::BadDimensions);
 	}
-	SetSize((int) bmih.biWidth , (int) bmih.biHeight);
+	Layout.Width = (int) bmih.biWidth;
+	Layout.Height = abs((int) bmih.biHeight);
+	Layout.TopDown = (int) bmih.biHeight < 0;
 
-	// some preliminaries
+	// nothing has been allocated yet, so oversized images are turned away
+	// here, before the caller sizes anything from these headers
 
-	double dBytesPerPixel = ((double) BitDepth ) / 8.0;
-	double dBytesPerRow = dBytesPerPixel * (Width + 0.0);
-	dBytesPerRow = ceil(dBytesPerRow);
+	const BMPLimits& Limits = g_limits;
+	if (Layout.Width > Limits.MaxWidth or Layout.Height > Limits.MaxHeight or
+		(long long) Layout.Width * Layout.Height > Limits.MaxPixels or
+		not PixelCountFits(Layout.Width, Layout.Height) or
+		(long long) bmfh.bfSize > Limits.MaxBytes or (long long) bmfh.bfOffBits > Limits.MaxBytes or
+		(long long) bmih.biSizeImage > Limits.MaxBytes)
+	{
+		if (g_exceptions) {
+			throw runtime_error("EasyBMP::ReadFromStream: the headers (" + to_string(Layout.Width) + "x" +
+								to_string(Layout.Height) + ", " + to_string(bmfh.bfSize) + " bytes) exceed the decoding limits.");
+		}
+		return Source.Fail(BMPError::LimitExceeded);
+	}
+
+	// when the length of the source is known, the file must be as long
+	// as it says it is
+
+	size_t Available;
+	if (Source.Remaining(Available) and bmfh.bfSize > Source.Offset() + (unsigned long long) Available) {
+		if (g_exceptions) {
+			throw runtime_error("EasyBMP::ReadFromStream: the header gives a file size of " + to_string(bmfh.bfSize) +
+								" bytes, but the file has only " + to_string(Source.Offset() + Available) + ".");
+		}
+		return Source.Fail(BMPError::Truncated);
+	}
+
+	// Extended info headers (V2 to V5) start with the red, green, blue
+	// and alpha masks; a plain 40-byte header is followed by the masks
+	// when bit fields are used. Everything else in an extended header
+	// (color space, gamma, ICC profile location) is skipped.
+
+	bool BitFields = bmih.biCompression == 3 or bmih.biCompression == 6;
+	ebmpDWORD* Masks = Layout.Masks;
+	for (int n = 0; n < 4; n++) Masks[n] = 0;
+	streamoff Consumed = 14 + 40;
 
-	int BytePaddingPerRow = 4 - ((int) (dBytesPerRow)) % 4;
-	if (BytePaddingPerRow == 4) BytePaddingPerRow = 0;
+	int MaskCount = 0;
+	if (bmih.biSize > 40) MaskCount = (int) min<ebmpDWORD>((bmih.biSize - 40) / 4, 4);
+	else if (BitFields) MaskCount = bmih.biCompression == 6 ? 4 : 3;
+
+	const ebmpBYTE* MaskData = Source.Take(4 * MaskCount);
+	NotCorrupted &= MaskData != nullptr;
+	for (int n = 0; n < MaskCount and MaskData; n++) {
+		Masks[n] = GetDWORD(MaskData + 4 * n);
+	}
+	Consumed += 4 * MaskCount;
+	if (bmih.biSize > 40) {
+		NotCorrupted &= Source.Skip((size_t) (14 + (streamoff) bmih.biSize - Consumed));
+		Consumed = 14 + (streamoff) bmih.biSize;
+	}
+	if (not NotCorrupted) {
+		if (g_exceptions) {
+			throw runtime_error("EasyBMP::ReadFromStream: file is corrupted");
+		}
+		return Source.Fail(BMPError::Truncated);
+	}
+
+	// without bit fields, 16-bit files use a 5-5-5 layout
+	if (BitDepth == 16 and not BitFields) {
+		Masks[0] = 31744; // bits 2-6
+		Masks[1] = 992;   // bits 7-11
+		Masks[2] = 31;    // bits 12-16
+	}
 
 	// if < 16 bits, read the palette
 
 	if (BitDepth < 16) {
 		// determine the number of colors specified in the
-		// color table
-
-		int NumberOfColorsToRead = ((int) bmfh.bfOffBits - 54 ) / 4;
-		if (NumberOfColorsToRead > IntPow(2, BitDepth)) NumberOfColorsToRead = IntPow(2, BitDepth);
+		// color table, which must also fit before the pixel data
 
-		int n;
-		for (n = 0; n < NumberOfColorsToRead; n++)
-		{
-			SafeFread((char*) &(Colors[n]), 4, 1, in);
+		int NumberOfColors = IntPow(2, BitDepth);
+		int NumberOfColorsToRead = bmih.biClrUsed ? (int) min<ebmpDWORD>(bmih.biClrUsed, 256) : NumberOfColors;
+		if (bmfh.bfOffBits > Consumed and NumberOfColorsToRead > (bmfh.bfOffBits - Consumed) / 4) {
+			NumberOfColorsToRead = (int) ((bmfh.bfOffBits - Consumed) / 4);
 		}
-		for (n = NumberOfColorsToRead; n < TellNumberOfColors(); n++)
-		{
+		if (NumberOfColorsToRead > NumberOfColors) NumberOfColorsToRead = NumberOfColors;
+
+		// file entries are blue, green, red, reserved, as in RGBApixel
+		const ebmpBYTE* Palette = Source.Take(4 * (size_t) NumberOfColorsToRead);
+		int n = 0;
+		if (Palette) {
+			memcpy(Layout.Palette, Palette, 4 * (size_t) NumberOfColorsToRead);
+			n = NumberOfColorsToRead;
+		}
+		for (; n < NumberOfColors; n++) {
 			RGBApixel WHITE;
 			WHITE.Red = 255;
 			WHITE.Green = 255;
 			WHITE.Blue = 255;
 			WHITE.Alpha = 0;
-			SetColor(n, WHITE);
-		}
-	}
-
-	// skip blank data if bfOffBits so indicates
-
-	int BytesToSkip = bmfh.bfOffBits - 54;;
-	if (BitDepth < 16) BytesToSkip -= 4*IntPow(2,BitDepth);
-	if (BitDepth == 16 and bmih.biCompression == 3) BytesToSkip -= 3*4;
-	if (BytesToSkip < 0 ) BytesToSkip = 0;
-	if (BytesToSkip > 0 and BitDepth != 16) {
-//		if (g_exceptions) {
-//			throw runtime_error("EasyBMP::ReadFromStream: extra meta data detected");
-//			// " Data will be skipped."
-//		}
-		ebmpBYTE* TempSkipBYTE;
-		TempSkipBYTE = new ebmpBYTE[BytesToSkip];
-		SafeFread((char*) TempSkipBYTE, BytesToSkip, 1, in);
-		delete [] TempSkipBYTE;
-	}
-
-	// This code reads 1, 4, 8, 24, and 32-bpp files
-	// with a more-efficient buffered technique.
-
-	int i, j, col, row;
-	if (BitDepth != 16) {
-		int BufferSize = (int) ((Width * BitDepth) / 8.0 );
-		while (8 * BufferSize < Width * BitDepth) BufferSize++;
-		while (BufferSize % 4) BufferSize++;
-		unique_ptr<ebmpBYTE> Buffer(new ebmpBYTE[BufferSize]);
-		j = Height - 1;
-		while (j > -1) {
-			in.read((char*) Buffer.get(), BufferSize);
-			if (in.gcount() < BufferSize) {
-				j = -1;
-				if (g_exceptions) {
-					throw runtime_error("EasyBMP::ReadFromStream: could not read proper amount of data.");
-				}
+			Layout.Palette[n] = WHITE;
+		}
+		Consumed += 4 * NumberOfColorsToRead;
+	}
+
+	// jump straight to the pixel data if bfOffBits so indicates
+
+	if (bmfh.bfOffBits > Consumed and not Source.Skip((size_t) (bmfh.bfOffBits - Consumed))) {
+		if (g_exceptions) {
+			throw runtime_error("EasyBMP::ReadFromStream: could not read proper amount of data.");
+		}
+		return Source.Fail(BMPError::Truncated);
+	}
+
+	// Uncompressed pixel data has a known size, which must fit within
+	// the limits and, when the length of the source is known, within
+	// the source. RLE data only declares its size in biSizeImage, which
+	// must fit within the source too; the pixel limit bounds the rest.
+
+	if (Layout.Compression == 1 or Layout.Compression == 2) {
+		if (Source.Remaining(Available) and bmih.biSizeImage > Available) {
+			if (g_exceptions) {
+				throw runtime_error("EasyBMP::ReadFromStream: the header calls for " + to_string(bmih.biSizeImage) +
+									" bytes of RLE data, but only " + to_string(Available) + " remain.");
 			}
-			else {
-				
-				// If the image has a negative height, then the pixel buffer is 
-				// stored top to bottom rather than bottom to top.
-				row = VerticalFlip ? Height -1 -j : j;
-
-				bool Success = false;
-				if (BitDepth == 1 ) Success = Read1bitRow( Buffer.get(), BufferSize, row);
-				if (BitDepth == 4 ) Success = Read4bitRow( Buffer.get(), BufferSize, row);
-				if (BitDepth == 8 ) Success = Read8bitRow( Buffer.get(), BufferSize, row);
-				if (BitDepth == 24) Success = Read24bitRow(Buffer.get(), BufferSize, row);
-				if (BitDepth == 32) Success = Read32bitRow(Buffer.get(), BufferSize, row);
-				if (not Success) {
-					if (g_exceptions) {
-						throw runtime_error("EasyBMP::ReadFromStream: could not read enough pixel data.");
-					}
-					j = -1;
-				}
+			return Source.Fail(BMPError::Truncated);
+		}
+	}
+	else {
+		unsigned long long PixelBytes = RowBytesFor(Layout.Width, BitDepth) * (unsigned long long) Layout.Height;
+		if (Source.Offset() + PixelBytes > (unsigned long long) Limits.MaxBytes) {
+			if (g_exceptions) {
+				throw runtime_error("EasyBMP::ReadFromStream: " + to_string(PixelBytes) +
+									" bytes of pixel data exceed the decoding limits.");
 			}
-			j--;
+			return Source.Fail(BMPError::LimitExceeded);
+		}
+		if (Source.Remaining(Available) and PixelBytes > Available) {
+			if (g_exceptions) {
+				throw runtime_error("EasyBMP::ReadFromStream: the headers call for " + to_string(PixelBytes) +
+									" bytes of pixel data, but only " + to_string(Available) + " remain.");
+			}
+			return Source.Fail(BMPError::Truncated);
+		}
+	}
+	return true;
+}
+
+// Row decoders for uncompressed files. Each turns one stored row into
+// Width pixels, left to right.
+
+static void DecodeIndexedRow(const ebmpBYTE* Buffer, int Width, int BitDepth,
+							 const RGBApixel* Palette, RGBApixel* Row)
+{
+	if (BitDepth == 8) {
+		for (int i = 0; i < Width; i++) Row[i] = Palette[Buffer[i]];
+		return;
+	}
+	int PerByte = 8 / BitDepth;
+	int Mask = (1 << BitDepth) - 1;
+	for (int i = 0; i < Width; i++) {
+		int Shift = 8 - BitDepth * (i % PerByte + 1);
+		Row[i] = Palette[(Buffer[i / PerByte] >> Shift) & Mask];
+	}
+}
+
+static void Decode24bitRow(const ebmpBYTE* Buffer, int Width, RGBApixel* Row)
+{
+	for (int i = 0; i < Width; i++) {
+		Row[i].Blue = Buffer[3 * i];
+		Row[i].Green = Buffer[3 * i + 1];
+		Row[i].Red = Buffer[3 * i + 2];
+		Row[i].Alpha = 0;
+	}
+}
+
+// 16-bit fields keep the old EasyBMP scaling: each is cut to its top five
+// bits and multiplied by 8.
+
+class WordFieldDecoder {
+public:
+	WordFieldDecoder(const ebmpDWORD Masks[4])
+	{
+		// output order is Blue, Green, Red
+		const ebmpDWORD Ordered[3] = { Masks[2], Masks[1], Masks[0] };
+		for (int c = 0; c < 3; c++) {
+			Mask[c] = (ebmpWORD) Ordered[c];
+			Shift[c] = 0;
+			ebmpWORD TempShiftWORD = Mask[c];
+			while (TempShiftWORD > 31) { TempShiftWORD = TempShiftWORD>>1; Shift[c]++; }
 		}
 	}
 
-	if (BitDepth == 16)
+	void Decode(const ebmpBYTE* Buffer, int Width, RGBApixel* Row) const
 	{
-		int DataBytes = Width * 2;
-		int PaddingBytes = (4 - DataBytes % 4) % 4;
+		for (int i = 0; i < Width; i++) {
+			ebmpWORD TempWORD = GetWORD(Buffer + 2 * i);
+			ebmpBYTE* Out = (ebmpBYTE*) &Row[i];
+			for (int c = 0; c < 3; c++) {
+				Out[c] = (ebmpBYTE) (8 * ((TempWORD & Mask[c]) >> Shift[c]));
+			}
+			Row[i].Alpha = 0;
+		}
+	}
 
-		// set the default mask
+private:
+	ebmpWORD Mask[3];
+	int Shift[3];
+};
 
-		ebmpWORD BlueMask = 31; // bits 12-16
-		ebmpWORD GreenMask = 992; // bits 7-11
-		ebmpWORD RedMask = 31744; // bits 2-6
+// Decodes the pixel data that follows the headers and hands each row to
+// Deliver as Width pixels, with the row numbered from the top of the
+// image. Rows arrive in file order.
 
-		// read the bit fields, if necessary, to
-		// override the default 5-5-5 mask
+bool BMP::DecodeRows(ByteSource& Source, const FileLayout& Layout,
+					 const function<void(int, const RGBApixel*)>& Deliver)
+{
+	// RLE8 and RLE4 data is decoded as it arrives
+	if (Layout.Compression == 1 or Layout.Compression == 2) {
+		return DecodeRLE(Source, Layout, Deliver);
+	}
+
+	int Width = Layout.Width;
+	int Height = Layout.Height;
+	int BitDepth = Layout.BitDepth;
+	size_t RowBytes = (size_t) RowBytesFor(Width, BitDepth);
+
+	bool BitFields = Layout.Compression == 3 or Layout.Compression == 6;
+	unique_ptr<BitFieldDecoder> Fields;
+	if (BitDepth == 32 and BitFields) Fields.reset(new BitFieldDecoder(Layout.Masks));
+	WordFieldDecoder Words(Layout.Masks);
+
+	// rows are read about a megabyte at a time and each batch is decoded
+	// in parallel; a short read still delivers the rows it completed
+	int BatchRows = (int) max<size_t>(1, EncodeStagingSize / RowBytes);
+	for (int Done = 0; Done < Height; ) {
+		int Batch = min(BatchRows, Height - Done);
+		size_t Got = 0;
+		const ebmpBYTE* Data = Source.TakeUpTo(Batch * RowBytes, Got);
+		int Complete = (int) (Got / RowBytes);
+
+		ParallelFor(0, Complete, GrainFor(Width), [&](int Begin, int End) {
+			static thread_local ScratchVector<RGBApixel> Decoded;
+			Decoded.resize(Width);
+			for (int k = Begin; k < End; k++) {
+				const ebmpBYTE* Buffer = Data + k * RowBytes;
+				if (BitDepth <= 8) DecodeIndexedRow(Buffer, Width, BitDepth, Layout.Palette, Decoded.data());
+				if (BitDepth == 16) Words.Decode(Buffer, Width, Decoded.data());
+				if (BitDepth == 24) Decode24bitRow(Buffer, Width, Decoded.data());
+				if (BitDepth == 32 and Fields) Fields->Decode(Buffer, Decoded.data(), Width);
+				else if (BitDepth == 32) memcpy(Decoded.data(), Buffer, 4 * (size_t) Width);
+
+				// If the image has a negative height, then the pixel buffer
+				// is stored top to bottom rather than bottom to top.
+				int j = Done + k;
+				Deliver(Layout.TopDown ? j : Height -1 -j, Decoded.data());
+			}
+		});
+
+		if (Complete < Batch) {
+			if (g_exceptions) {
+				throw runtime_error("EasyBMP::ReadFromStream: could not read proper amount of data.");
+			}
+			return Source.Fail(BMPError::Truncated);
+		}
+		Done += Batch;
+	}
+	return true;
+}
 
-		if (bmih.biCompression != 0) {
-			// read the three bit masks
+bool BMP::DecodeRLE(ByteSource& Source, const FileLayout& Layout,
+					const function<void(int, const RGBApixel*)>& Deliver)
+{
+	bool FourBit = Layout.Compression == 2;
+	int Width = Layout.Width;
+	int Height = Layout.Height;
+	const RGBApixel* Colors = Layout.Palette;
+
+	// RLE data is decoded as it arrives, a chunk at a time, and no byte
+	// past a known compressed size is consumed
+	ebmpDWORD Remaining = Layout.CompressedSize ? Layout.CompressedSize : ~(ebmpDWORD) 0;
+	const ebmpBYTE* Chunk = nullptr;
+	size_t Position = 0, Available = 0;
+	auto Next = [&](ebmpBYTE& Byte) {
+		if (Position == Available) {
+			if (not Remaining) return false;
+			Chunk = Source.TakeSome(Remaining, Available);
+			Remaining -= (ebmpDWORD) Available;
+			Position = 0;
+			if (not Available) return false;
+		}
+		Byte = Chunk[Position++];
+		return true;
+	};
+
+	// pixels skipped by delta and end-of-line escapes get color 0
+	ScratchVector<RGBApixel> Line(Width, Colors[0]);
+
+	// x counts pixels from the left, y counts rows from the bottom
+	int x = 0, y = 0;
+	auto Put = [&](int Index) {
+		if (x < Width) Line[x] = Colors[Index];
+		x++;
+	};
+	auto EndRow = [&]() {
+		if (y < Height) Deliver(Layout.TopDown ? y : Height - 1 - y, Line.data());
+		fill(Line.begin(), Line.end(), Colors[0]);
+		y++;
+	};
+
+	bool Truncated = false;
+	while (y < Height) {
+		ebmpBYTE Count, Value;
+		if (not Next(Count) or not Next(Value)) { Truncated = true; break; }
+
+		if (Count > 0) {
+			// encoded run: Count pixels of one index, or of two alternating nibbles
+			for (int n = 0; n < Count; n++) {
+				Put(FourBit ? (n % 2 ? Value & 15 : Value >> 4) : Value);
+			}
+			continue;
+		}
 
-			ebmpWORD TempMaskWORD;
-			//ebmpWORD ZeroWORD;
+		if (Value == 0) { x = 0; EndRow(); continue; } // end of line
+		if (Value == 1) break;                         // end of bitmap
+		if (Value == 2) {                              // delta
+			ebmpBYTE dx, dy;
+			if (not Next(dx) or not Next(dy)) { Truncated = true; break; }
+			x += dx;
+			for (int n = 0; n < dy; n++) EndRow();
+			continue;
+		}
 
-			SafeFread((char*) &RedMask, 2, 1, in);
-			if (IsBigEndian()) RedMask = FlipWORD(RedMask);
-			SafeFread((char*) &TempMaskWORD, 2, 1, in);
+		// absolute mode: Value literal pixels, padded to a 16-bit boundary
+		int DataBytes = FourBit ? (Value + 1) / 2 : Value;
+		ebmpBYTE Literal = 0;
+		for (int n = 0; n < Value; n++) {
+			if ((not FourBit or n % 2 == 0) and not Next(Literal)) { Truncated = true; break; }
+			Put(FourBit ? (n % 2 ? Literal & 15 : Literal >> 4) : Literal);
+		}
+		if (not Truncated and DataBytes % 2 and not Next(Literal)) Truncated = true;
+		if (Truncated) break;
+	}
 
-			SafeFread((char*) &GreenMask, 2, 1, in);
-			if (IsBigEndian()) GreenMask = FlipWORD(GreenMask);
-			SafeFread((char*) &TempMaskWORD, 2, 1, in);
+	// the rows not reached yet, including the partial one, are delivered
+	// as they stand
+	while (y < Height) EndRow();
 
-			SafeFread( (char*) &BlueMask, 2, 1, in);
-			if (IsBigEndian()) BlueMask = FlipWORD(BlueMask);
-			SafeFread((char*) &TempMaskWORD, 2, 1, in);
+	if (Truncated) {
+		if (g_exceptions) {
+			throw runtime_error("EasyBMP::ReadFromStream: RLE data ended unexpectedly.");
 		}
+		return Source.Fail(BMPError::Truncated);
+	}
+	return true;
+}
 
-		// read and skip any meta data
+// Repacks decoded pixels into one of the caller-facing layouts.
 
-		if (BytesToSkip > 0) {
-//			if (g_exceptions) {
-//				throw runtime_error("EasyBMP::ReadFromStream: extra meta data detected");
-//			}
-			ebmpBYTE* TempSkipBYTE;
-			TempSkipBYTE = new ebmpBYTE[BytesToSkip];
-			SafeFread((char*) TempSkipBYTE, BytesToSkip, 1, in);
-			delete [] TempSkipBYTE;
+static void ConvertRow(const RGBApixel* Row, ebmpBYTE* Out, int Width, PixelFormat Format)
+{
+	switch (Format) {
+	case PixelFormat::BGRA8:
+		memcpy(Out, Row, 4 * (size_t) Width);
+		break;
+	case PixelFormat::RGBA8:
+		for (int i = 0; i < Width; i++, Out += 4) {
+			Out[0] = Row[i].Red; Out[1] = Row[i].Green; Out[2] = Row[i].Blue; Out[3] = Row[i].Alpha;
+		}
+		break;
+	case PixelFormat::BGR8:
+		for (int i = 0; i < Width; i++, Out += 3) {
+			Out[0] = Row[i].Blue; Out[1] = Row[i].Green; Out[2] = Row[i].Red;
+		}
+		break;
+	case PixelFormat::RGB8:
+		for (int i = 0; i < Width; i++, Out += 3) {
+			Out[0] = Row[i].Red; Out[1] = Row[i].Green; Out[2] = Row[i].Blue;
+		}
+		break;
+	case PixelFormat::Gray8:
+		// Rec. 601 luma in 8-bit fixed point
+		for (int i = 0; i < Width; i++) {
+			Out[i] = (ebmpBYTE) ((77 * Row[i].Red + 150 * Row[i].Green + 29 * Row[i].Blue + 128) >> 8);
 		}
+		break;
+	}
+}
 
-		// determine the red, green and blue shifts
+bool BMP::DecodeInto(ByteSource& Source, void* Target, size_t Stride, PixelFormat Format, bool BottomUp)
+{
+	FileLayout Layout;
+	if (not ReadLayout(Source, Layout)) return false;
 
-		int GreenShift = 0;
-		ebmpWORD TempShiftWORD = GreenMask;
-		while (TempShiftWORD > 31) { TempShiftWORD = TempShiftWORD>>1; GreenShift++; }
-		int BlueShift = 0;
-		TempShiftWORD = BlueMask;
-		while (TempShiftWORD > 31) { TempShiftWORD = TempShiftWORD>>1; BlueShift++; }
-		int RedShift = 0;
-		TempShiftWORD = RedMask;
-		while (TempShiftWORD > 31) { TempShiftWORD = TempShiftWORD>>1; RedShift++; }
+	if (Stride < BytesPerPixel(Format) * Layout.Width) {
+		if (g_exceptions) {
+			throw invalid_argument("EasyBMP::DecodeInto: a stride of " + to_string(Stride) +
+								   " bytes is too small for " + to_string(Layout.Width) + " pixels.");
+		}
+		return Source.Fail(BMPError::InvalidArgument);
+	}
 
-		// read the actual pixels
+	ebmpBYTE* Base = (ebmpBYTE*) Target;
+	return DecodeRows(Source, Layout, [&](int Row, const RGBApixel* Decoded) {
+		size_t Line = (size_t) (BottomUp ? Layout.Height - 1 - Row : Row);
+		ConvertRow(Decoded, Base + Line * Stride, Layout.Width, Format);
+	});
+}
 
-		for (j = Height - 1; j >= 0; j--) {
-			i = 0;
-			int ReadNumber = 0;
-			while (ReadNumber < DataBytes) {
-				ebmpWORD TempWORD;
-				SafeFread((char*) &TempWORD, 2, 1, in);
-				if (IsBigEndian()) TempWORD = FlipWORD(TempWORD);
-				ReadNumber += 2;
+bool BMP::DecodeInto(const string& FileName, void* Target, size_t Stride, PixelFormat Format, bool BottomUp)
+{
+	ifstream stream(FileName, ios::binary);
+	if (not stream) {
+		if (g_exceptions) {
+			throw runtime_error("EasyBMP::DecodeInto: cannot open file " + FileName + " for input.");
+		}
+		return false;
+	}
+	ByteSource Source(stream);
+	return DecodeInto(Source, Target, Stride, Format, BottomUp);
+}
+
+bool BMP::DecodeInto(const unsigned char* buffer, size_t size, void* Target, size_t Stride,
+					 PixelFormat Format, bool BottomUp)
+{
+	ByteSource Source(buffer, size);
+	return DecodeInto(Source, Target, Stride, Format, BottomUp);
+}
+
+bool BMP::ReadDimensions(const string& FileName, int& Width, int& Height)
+{
+	ifstream stream(FileName, ios::binary);
+	if (not stream) {
+		if (g_exceptions) {
+			throw runtime_error("EasyBMP::ReadDimensions: cannot open file " + FileName + " for input.");
+		}
+		return false;
+	}
+	ByteSource Source(stream);
+	FileLayout Layout;
+	if (not ReadLayout(Source, Layout)) return false;
+	Width = Layout.Width;
+	Height = Layout.Height;
+	return true;
+}
 
-				ebmpWORD Red = RedMask & TempWORD;
-				ebmpWORD Green = GreenMask & TempWORD;
-				ebmpWORD Blue = BlueMask & TempWORD;
+bool BMP::ReadDimensions(const unsigned char* buffer, size_t size, int& Width, int& Height)
+{
+	ByteSource Source(buffer, size);
+	FileLayout Layout;
+	if (not ReadLayout(Source, Layout)) return false;
+	Width = Layout.Width;
+	Height = Layout.Height;
+	return true;
+}
 
-				ebmpBYTE BlueBYTE = (ebmpBYTE) 8 * (Blue >> BlueShift);
-				ebmpBYTE GreenBYTE = (ebmpBYTE) 8 * (Green >> GreenShift);
-				ebmpBYTE RedBYTE = (ebmpBYTE) 8 * (Red >> RedShift);
+// Length of the run starting at Data in which every byte repeats the
+// one Period bytes earlier, capped at Max. Period 1 finds runs of one
+// value (RLE8), period 2 finds runs of an alternating pair (RLE4, one
+// index per byte). Sixteen bytes are compared per step.
 
-				row = VerticalFlip   ? Height -1 -j : j;
-				col = HorizontalFlip ? Width  -1 -i : i;
+static int RunLength(const ebmpBYTE* Data, int Max, int Period)
+{
+	if (Max <= Period) return Max;
+	int n = Period;
+#ifdef EasyBMP_SSE2
+	while (n + 16 <= Max) {
+		__m128i Ahead  = _mm_loadu_si128((const __m128i*) (Data + n));
+		__m128i Behind = _mm_loadu_si128((const __m128i*) (Data + n - Period));
+		int Equal = _mm_movemask_epi8(_mm_cmpeq_epi8(Ahead, Behind));
+		if (Equal != 0xFFFF) {
+			while (Equal & 1) { Equal >>= 1; n++; }
+			return n;
+		}
+		n += 16;
+	}
+#endif
+	while (n < Max and Data[n] == Data[n - Period]) n++;
+	return n;
+}
 
-				(Pixels[col][row]).Red = RedBYTE;
-				(Pixels[col][row]).Green = GreenBYTE;
-				(Pixels[col][row]).Blue = BlueBYTE;
+// Encodes one row of palette indices (one per byte) as RLE8 or RLE4
+// runs and absolute blocks, without the end-of-line escape.
+
+static void EncodeRLERow(const ebmpBYTE* Indices, int Width, bool FourBit, ScratchVector<ebmpBYTE>& Output)
+{
+	int Period = FourBit ? 2 : 1;
+	int MinRun = FourBit ? 4 : 3;
 
-				i++;
+	int i = 0;
+	while (i < Width) {
+		int Run = RunLength(Indices + i, min(Width - i, 255), Period);
+		if (Run >= MinRun or Width - i < 3) {
+			Output.push_back((ebmpBYTE) Run);
+			Output.push_back(FourBit ? (ebmpBYTE) ((Indices[i] << 4) | (Run > 1 ? Indices[i + 1] : 0)) : Indices[i]);
+			i += Run;
+			continue;
+		}
+
+		// gather literal pixels until a worthwhile run starts
+		int End = i + 1;
+		while (End < Width and End - i < 255 and
+			   RunLength(Indices + End, min(Width - End, MinRun), Period) < MinRun) End++;
+		int Count = End - i;
+
+		if (Count < 3) {
+			// absolute mode needs at least three pixels; use short runs instead
+			if (FourBit) {
+				Output.push_back((ebmpBYTE) Count);
+				Output.push_back((ebmpBYTE) ((Indices[i] << 4) | (Count > 1 ? Indices[i + 1] : 0)));
 			}
-			ReadNumber = 0;
-			while (ReadNumber < PaddingBytes) {
-				ebmpBYTE TempBYTE;
-				SafeFread((char*) &TempBYTE, 1, 1, in);
-				ReadNumber++;
+			else {
+				for (int k = i; k < End; k++) {
+					Output.push_back(1);
+					Output.push_back(Indices[k]);
+				}
 			}
+			i = End;
+			continue;
 		}
-	}
 
-	return true;
+		Output.push_back(0);
+		Output.push_back((ebmpBYTE) Count);
+		int DataBytes = 0;
+		for (int k = 0; k < Count; k += Period, DataBytes++) {
+			if (FourBit) Output.push_back((ebmpBYTE) ((Indices[i + k] << 4) | (k + 1 < Count ? Indices[i + k + 1] : 0)));
+			else Output.push_back(Indices[i + k]);
+		}
+		if (DataBytes % 2) Output.push_back(0);
+		i = End;
+	}
 }
 
+void BMP::EncodeRLE(int Width, int Height, const RowSource& RowOf, ScratchVector<ebmpBYTE>& Output)
+{
+	// appends to Output; room for the indices, padded as an uncompressed 8-bit row
+	size_t BufferSize = ((size_t) Width + 3) / 4 * 4;
+	ScratchVector<ebmpBYTE> Indices(BufferSize);
+
+	for (int j = Height - 1; j >= 0; j--) {
+		Write8bitRow(RowOf(j), Indices.data(), BufferSize, 0);
+		EncodeRLERow(Indices.data(), Width, BitDepth == 4, Output);
+		Output.push_back(0);
+		Output.push_back(j > 0 ? 0 : 1); // end of line, or of bitmap
+	}
+}
 
 bool BMP::ReadFromFile(const string& FileName)
 {
@@ -941,15 +2325,44 @@ bool BMP::ReadFromFile(const string& FileName)
 	return false;
 }
 
+// Unlike ReadFromSource, a rejected header leaves the image as it was,
+// which keeps the failure path free of allocations.
+
+BMPStatus BMP::TryReadFromSource(ByteSource& Source)
+{
+	ExceptionScope Quiet(false);
+	FileLayout Layout;
+	if (ReadLayout(Source, Layout)) ReadPixels(Source, Layout);
+	return Source.Status();
+}
+
+BMPStatus BMP::TryReadFromFile(const string& FileName)
+{
+	ifstream stream(FileName, ios::binary);
+	if (not stream) return { BMPError::CannotOpen, 0 };
+	ByteSource Source(stream);
+	return TryReadFromSource(Source);
+}
+
+BMPStatus BMP::TryReadFromStream(istream& in)
+{
+	ByteSource Source(in);
+	return TryReadFromSource(Source);
+}
+
+BMPStatus BMP::TryReadFromBuffer(const unsigned char* buffer, size_t size)
+{
+	ByteSource Source(buffer, size);
+	return TryReadFromSource(Source);
+}
+
 bool BMP::ReadFromBuffer(const unsigned char *buffer, size_t size)
 {
 	// No need to catch exceptions for a buffer since we can't add useful info
 
-	// Dropping const with cast should be OK.
-	ReadBuf streambuffer((char*) buffer, size);
-	istream stream(&streambuffer);
-
-	return ReadFromStream(stream);
+	// parsed in place; rows are decoded straight from the caller's memory
+	ByteSource Source(buffer, size);
+	return ReadFromSource(Source);
 }
 
 
@@ -1104,6 +2517,9 @@ bool BMP::CreateStandardColorTable( void )
 	return true;
 }
 
+void BMP::SetRLECompression(bool Enable) { RLECompression = Enable; }
+bool BMP::TellRLECompression(void) const { return RLECompression; }
+
 void BMP::SetDPI(int HorizontalDPI, int VerticalDPI)
 {
 	XPelsPerMeter = (int) (HorizontalDPI * 39.37007874015748);
@@ -1111,17 +2527,17 @@ void BMP::SetDPI(int HorizontalDPI, int VerticalDPI)
 }
 
 // int BMP::TellVerticalDPI( void ) const
-int BMP::TellVerticalDPI( void )
+int BMP::TellVerticalDPI( void ) const
 {
-	if (not YPelsPerMeter) YPelsPerMeter = DefaultYPelsPerMeter;
-	return (int) (YPelsPerMeter / (double) 39.37007874015748);
+	int Pels = YPelsPerMeter ? YPelsPerMeter : DefaultYPelsPerMeter;
+	return (int) (Pels / (double) 39.37007874015748);
 }
 
 // int BMP::TellHorizontalDPI( void ) const
-int BMP::TellHorizontalDPI( void )
+int BMP::TellHorizontalDPI( void ) const
 {
-	if (not XPelsPerMeter) XPelsPerMeter = DefaultXPelsPerMeter;
-	return (int) (XPelsPerMeter / (double) 39.37007874015748);
+	int Pels = XPelsPerMeter ? XPelsPerMeter : DefaultXPelsPerMeter;
+	return (int) (Pels / (double) 39.37007874015748);
 }
 
 /* These functions are defined in EasyBMP_VariousBMPutilities.h */
@@ -1148,172 +2564,847 @@ BMFH GetBMFH(const string& szFileNameIn)
 	fread((char*) &(bmfh.bfReserved2), sizeof(ebmpWORD), 1, fp);
 	fread((char*) &(bmfh.bfOffBits), sizeof(ebmpDWORD), 1, fp);
 
-	fclose(fp);
+	fclose(fp);
+
+	if (IsBigEndian()) bmfh.SwitchEndianess();
+
+	return bmfh;
+}
+
+BMIH GetBMIH(const string& szFileNameIn)
+{
+	BMFH bmfh;
+	BMIH bmih;
+
+	FILE* fp = fopen(szFileNameIn.c_str(), "rb");
+	if (not fp) {
+		if (g_exceptions) {
+			throw runtime_error("EasyBMP::GetBMIH: cannot initialize from file " + szFileNameIn + ". "
+								"File cannot be opened or does not exist.");
+		}
+		return bmih;
+	}
+
+	// read the bmfh, i.e., first 14 bytes (just to get it out of the way);
+
+	ebmpBYTE TempBYTE;
+	for (int i = 14; i > 0; i--) fread((char*) &TempBYTE, sizeof(ebmpBYTE), 1, fp);
+
+	// read the bmih
+
+	fread((char*) &(bmih.biSize), sizeof(ebmpDWORD), 1, fp);
+	fread((char*) &(bmih.biWidth), sizeof(ebmpDWORD), 1, fp);
+	fread((char*) &(bmih.biHeight), sizeof(ebmpDWORD), 1, fp);
+	fread((char*) &(bmih.biPlanes), sizeof(ebmpWORD), 1, fp);
+
+	fread((char*) &(bmih.biBitCount), sizeof(ebmpWORD), 1, fp);
+	fread((char*) &(bmih.biCompression), sizeof(ebmpDWORD), 1, fp);
+	fread((char*) &(bmih.biSizeImage), sizeof(ebmpDWORD), 1, fp);
+	fread((char*) &(bmih.biXPelsPerMeter), sizeof(ebmpDWORD), 1, fp);
+
+	fread((char*) &(bmih.biYPelsPerMeter), sizeof(ebmpDWORD), 1, fp);
+	fread((char*) &(bmih.biClrUsed), sizeof(ebmpDWORD), 1, fp);
+	fread((char*) &(bmih.biClrImportant), sizeof(ebmpDWORD), 1, fp);
+
+	fclose(fp);
+
+	if (IsBigEndian()) bmih.SwitchEndianess();
+
+	return bmih;
+}
+
+void DisplayBitmapInfo(const string& szFileNameIn)
+{
+	FILE* fp = fopen(szFileNameIn.c_str(),"rb");
+	if (not fp) {
+		if (g_exceptions) {
+			throw runtime_error("EasyBMP::DisplayBitmapInfo: cannot initialize from file " + szFileNameIn + ". "
+								"File cannot be opened or does not exist.");
+		}
+		return;
+	}
+	fclose(fp);
+
+	// don't duplicate work! Just use the functions from above!
+
+	BMFH bmfh = GetBMFH(szFileNameIn);
+	BMIH bmih = GetBMIH(szFileNameIn);
+
+	cout << "File information for file " << szFileNameIn
+		 << ":" << endl << endl;
+
+	cout << "BITMAPFILEHEADER:" << endl
+		 << "bfType: " << bmfh.bfType << endl
+		 << "bfSize: " << bmfh.bfSize << endl
+		 << "bfReserved1: " << bmfh.bfReserved1 << endl
+		 << "bfReserved2: " << bmfh.bfReserved2 << endl
+		 << "bfOffBits: " << bmfh.bfOffBits << endl << endl;
+
+	cout << "BITMAPINFOHEADER:" << endl
+		 << "biSize: " << bmih.biSize << endl
+		 << "biWidth: " << (int) bmih.biWidth << endl
+		 << "biHeight: " << (int) bmih.biHeight << endl
+		 << "biPlanes: " << bmih.biPlanes << endl
+		 << "biBitCount: " << bmih.biBitCount << endl
+		 << "biCompression: " << bmih.biCompression << endl
+		 << "biSizeImage: " << bmih.biSizeImage << endl
+		 << "biXPelsPerMeter: " << bmih.biXPelsPerMeter << endl
+		 << "biYPelsPerMeter: " << bmih.biYPelsPerMeter << endl
+		 << "biClrUsed: " << bmih.biClrUsed << endl
+		 << "biClrImportant: " << bmih.biClrImportant << endl << endl;
+}
+
+int GetBitmapColorDepth(const string& szFileNameIn)
+{
+	BMIH bmih = GetBMIH(szFileNameIn);
+	return (int) bmih.biBitCount;
+}
+
+void PixelToPixelCopy(const BMP& From, int FromX, int FromY,
+                      BMP& To, int ToX, int ToY)
+{
+	To(ToX,ToY) = From(FromX,FromY);
+}
+
+void PixelToPixelCopyTransparent(const BMP& From, int FromX, int FromY,
+                                 BMP& To, int ToX, int ToY,
+                                 RGBApixel& Transparent)
+{
+	if (From(FromX,FromY).Red != Transparent.Red or
+		From(FromX,FromY).Green != Transparent.Green or
+		From(FromX,FromY).Blue != Transparent.Blue)
+	{
+		To(ToX,ToY) = From(FromX,FromY);
+	}
+}
+
+void RangedPixelToPixelCopy(const BMP& From, int FromL , int FromR, int FromB, int FromT,
+                            BMP& To, int ToX, int ToY )
+{
+	// make sure the conventions are followed
+	if (FromB < FromT )
+	{ int Temp = FromT; FromT = FromB; FromB = Temp; }
+
+	// make sure that the copied regions exist in both bitmaps
+	if (FromR >= abs(From.TellWidth())) FromR = abs(From.TellWidth()) - 1;
+	if (FromL < 0) FromL = 0;
+
+	if (FromB >= abs(From.TellHeight())) FromB = abs(From.TellHeight()) - 1;
+	if (FromT < 0) FromT = 0;
+
+	if (ToX + (FromR - FromL) >= abs(To.TellWidth()))  FromR = abs(To.TellWidth())  - 1 + FromL - ToX;
+	if (ToY + (FromB - FromT) >= abs(To.TellHeight())) FromB = abs(To.TellHeight()) - 1 + FromT - ToY;
+
+	int i, j;
+	for (j = FromT; j <= FromB; j++) {
+		for (i = FromL; i <= FromR; i++) {
+			PixelToPixelCopy(From, i, j,
+							 To, ToX + (i - FromL), ToY + (j - FromT));
+		}
+	}
+}
+
+// A work-stealing pool shared by every parallel routine in the library.
+// Each worker owns a deque of chunks: it takes work from the back of its
+// own deque and, once that is empty, steals from the front of the others.
+// The thread that called ParallelFor steals as well rather than sitting
+// idle, and calls from several user threads at once simply share the
+// workers. A ParallelFor issued from inside a chunk runs inline, so the
+// number of busy threads never exceeds the configured count.
+
+static thread_local bool InsideChunk = false;
+
+class ThreadPool {
+public:
+	static ThreadPool& Shared(void)
+	{
+		static ThreadPool Pool;
+		return Pool;
+	}
+
+	~ThreadPool() { Stop(); }
+
+	int Size(void)
+	{
+		return Threads;
+	}
+
+	// Waits for running jobs to finish; the workers are restarted on
+	// demand. A chunk cannot wait for the job it belongs to, so a call
+	// from inside one is refused.
+	void Resize(int Count)
+	{
+		if (InsideChunk) {
+			if (g_exceptions) {
+				throw logic_error("EasyBMP: BMP::threads() cannot be changed from inside a parallel loop");
+			}
+			return;
+		}
+		if (Count <= 0) Count = HardwareThreads();
+		unique_lock<mutex> Lock(ConfigLock);
+		Idle.wait(Lock, [this] { return ActiveRuns == 0; });
+		Stop();
+		Threads = Count;
+	}
+
+	void Run(int Begin, int End, int Grain, const function<void(int, int)>& Body)
+	{
+		int Count = End - Begin;
+		if (Count <= 0) return;
+		if (Grain < 1) Grain = 1;
+
+		// loops that stay on this thread never take ConfigLock; it is only
+		// needed to start the workers and count the jobs Resize waits for
+		if (InsideChunk or Threads < 2 or Count <= Grain) {
+			Body(Begin, End);
+			return;
+		}
+		int Chunks;
+		{
+			unique_lock<mutex> Lock(ConfigLock);
+			int Size = Threads;
+			if (Size < 2) {
+				Lock.unlock();
+				Body(Begin, End);
+				return;
+			}
+			if (Workers.empty()) Start();
+			ActiveRuns++;
+			Chunks = min(Count / Grain, 4 * Size);
+			if (Chunks < 2) Chunks = 2;
+		}
+
+		Job Work;
+		Work.Body = &Body;
+		Work.Exceptions = g_exceptions;
+		Work.Limits = g_limits;
+		Work.Allocator = g_allocator;
+		Work.Pending = Chunks;
+		for (int k = 0; k < Chunks; k++) {
+			Chunk Piece = { &Work, Begin + (int) ((long long) Count * k / Chunks),
+							Begin + (int) ((long long) Count * (k + 1) / Chunks) };
+			Queue& Target = *Queues[k % Queues.size()];
+			lock_guard<mutex> Lock(Target.Lock);
+			Target.Chunks.push_back(Piece);
+		}
+		Queued += Chunks;
+		{
+			lock_guard<mutex> Lock(WakeLock);
+		}
+		Wake.notify_all();
+
+		// help out until every chunk of this job has run
+		InsideChunk = true;
+		Chunk Piece;
+		while (Work.Pending > 0 and Steal(Piece, 0)) Execute(Piece);
+		InsideChunk = false;
+		{
+			unique_lock<mutex> Lock(Work.DoneLock);
+			Work.Done.wait(Lock, [&Work] { return Work.Pending == 0; });
+		}
+
+		{
+			lock_guard<mutex> Lock(ConfigLock);
+			if (--ActiveRuns == 0) Idle.notify_all();
+		}
+		if (Work.Error) rethrow_exception(Work.Error);
+	}
+
+	static int HardwareThreads(void)
+	{
+		int Count = (int) thread::hardware_concurrency();
+		return Count > 0 ? Count : 1;
+	}
+
+private:
+	struct Job {
+		const function<void(int, int)>* Body;
+		// the caller's per-thread policies, in force while its chunks run
+		bool Exceptions;
+		BMPLimits Limits;
+		BMPAllocator* Allocator;
+		atomic<int> Pending;
+		mutex DoneLock;
+		condition_variable Done;
+		exception_ptr Error;
+	};
+
+	struct Chunk {
+		Job* Owner;
+		int Begin;
+		int End;
+	};
+
+	struct Queue {
+		mutex Lock;
+		deque<Chunk> Chunks;
+	};
+
+	void Execute(const Chunk& Piece)
+	{
+		Job& Owner = *Piece.Owner;
+		bool Exceptions = g_exceptions;
+		BMPLimits Limits = g_limits;
+		BMPAllocator* Allocator = g_allocator;
+		g_exceptions = Owner.Exceptions;
+		g_limits = Owner.Limits;
+		g_allocator = Owner.Allocator;
+		try {
+			(*Owner.Body)(Piece.Begin, Piece.End);
+		}
+		catch (...) {
+			lock_guard<mutex> Lock(Owner.DoneLock);
+			if (not Owner.Error) Owner.Error = current_exception();
+		}
+		g_exceptions = Exceptions;
+		g_limits = Limits;
+		g_allocator = Allocator;
+		// the owner may return as soon as it can take DoneLock after this
+		lock_guard<mutex> Lock(Owner.DoneLock);
+		if (--Owner.Pending == 0) Owner.Done.notify_all();
+	}
+
+	bool Pop(int Self, Chunk& Piece)
+	{
+		Queue& Own = *Queues[Self];
+		lock_guard<mutex> Lock(Own.Lock);
+		if (Own.Chunks.empty()) return false;
+		Piece = Own.Chunks.back();
+		Own.Chunks.pop_back();
+		Queued--;
+		return true;
+	}
+
+	bool Steal(Chunk& Piece, int First)
+	{
+		for (size_t k = 0; k < Queues.size(); k++) {
+			Queue& Victim = *Queues[(First + k) % Queues.size()];
+			lock_guard<mutex> Lock(Victim.Lock);
+			if (Victim.Chunks.empty()) continue;
+			Piece = Victim.Chunks.front();
+			Victim.Chunks.pop_front();
+			Queued--;
+			return true;
+		}
+		return false;
+	}
+
+	void WorkerLoop(int Self)
+	{
+		InsideChunk = true;
+		Chunk Piece;
+		for (;;) {
+			if (Pop(Self, Piece) or Steal(Piece, Self + 1)) {
+				Execute(Piece);
+				continue;
+			}
+			unique_lock<mutex> Lock(WakeLock);
+			Wake.wait(Lock, [this] { return Stopping or Queued > 0; });
+			if (Stopping and Queued == 0) return;
+		}
+	}
+
+	// the calling thread is one of the Threads, so Threads - 1 workers
+	void Start(void)
+	{
+		int Count = Threads - 1;
+		for (int t = 0; t < Count; t++) Queues.emplace_back(new Queue);
+		for (int t = 0; t < Count; t++) Workers.emplace_back(&ThreadPool::WorkerLoop, this, t);
+	}
+
+	void Stop(void)
+	{
+		{
+			lock_guard<mutex> Lock(WakeLock);
+			Stopping = true;
+		}
+		Wake.notify_all();
+		for (auto& Worker : Workers) Worker.join();
+		Workers.clear();
+		Queues.clear();
+		Stopping = false;
+	}
+
+	// Threads is read without the lock and only written under it
+	mutex ConfigLock;
+	condition_variable Idle;
+	atomic<int> Threads{HardwareThreads()};
+	int ActiveRuns = 0;
+
+	vector<unique_ptr<Queue>> Queues;
+	vector<thread> Workers;
+	atomic<int> Queued{0};
+	mutex WakeLock;
+	condition_variable Wake;
+	bool Stopping = false;
+};
+
+int BMP::threads(void)            { return ThreadPool::Shared().Size(); }
+void BMP::threads(int count)      { ThreadPool::Shared().Resize(count); }
+
+void ParallelFor(int Begin, int End, int Grain, const function<void(int, int)>& Body)
+{
+	ThreadPool::Shared().Run(Begin, End, Grain, Body);
+}
+
+// Copies Count pixels from From to To, skipping every pixel whose red,
+// green and blue channels are all within Tolerance of the key colour.
+// Alpha is ignored in the comparison but copied with the pixel. The
+// SIMD paths build a per-pixel mask and blend, so there are no branches
+// on pixel data.
+
+static void CopyTransparentRun(const RGBApixel* From, RGBApixel* To, int Count,
+							   const RGBApixel& Transparent, int Tolerance)
+{
+	if (Tolerance < 0) Tolerance = 0;
+	if (Tolerance > 255) Tolerance = 255;
+
+	ebmpDWORD Key;
+	memcpy(&Key, &Transparent, 4);
+	ebmpBYTE Tol = (ebmpBYTE) Tolerance;
+	ebmpDWORD TolDWORD = Tol * 0x01010101u;
+
+	// byte 3 of each pixel is Alpha, regardless of endianness
+	ebmpDWORD ColorMask = 0;
+	memset(&ColorMask, 0xFF, 3);
+
+	int i = 0;
+
+#ifdef __AVX2__
+	{
+		const __m256i vKey  = _mm256_set1_epi32((int) Key);
+		const __m256i vTol  = _mm256_set1_epi32((int) TolDWORD);
+		const __m256i vMask = _mm256_set1_epi32((int) ColorMask);
+		const __m256i vZero = _mm256_setzero_si256();
+		for (; i + 8 <= Count; i += 8) {
+			__m256i s = _mm256_loadu_si256((const __m256i*) (From + i));
+			__m256i d = _mm256_loadu_si256((const __m256i*) (To + i));
+			__m256i Diff = _mm256_or_si256(_mm256_subs_epu8(s, vKey), _mm256_subs_epu8(vKey, s));
+			Diff = _mm256_and_si256(_mm256_subs_epu8(Diff, vTol), vMask);
+			__m256i Skip = _mm256_cmpeq_epi32(Diff, vZero);
+			d = _mm256_or_si256(_mm256_and_si256(Skip, d), _mm256_andnot_si256(Skip, s));
+			_mm256_storeu_si256((__m256i*) (To + i), d);
+		}
+	}
+#endif
+
+#ifdef EasyBMP_SSE2
+	{
+		const __m128i vKey  = _mm_set1_epi32((int) Key);
+		const __m128i vTol  = _mm_set1_epi32((int) TolDWORD);
+		const __m128i vMask = _mm_set1_epi32((int) ColorMask);
+		const __m128i vZero = _mm_setzero_si128();
+		for (; i + 4 <= Count; i += 4) {
+			__m128i s = _mm_loadu_si128((const __m128i*) (From + i));
+			__m128i d = _mm_loadu_si128((const __m128i*) (To + i));
+			__m128i Diff = _mm_or_si128(_mm_subs_epu8(s, vKey), _mm_subs_epu8(vKey, s));
+			Diff = _mm_and_si128(_mm_subs_epu8(Diff, vTol), vMask);
+			__m128i Skip = _mm_cmpeq_epi32(Diff, vZero);
+			d = _mm_or_si128(_mm_and_si128(Skip, d), _mm_andnot_si128(Skip, s));
+			_mm_storeu_si128((__m128i*) (To + i), d);
+		}
+	}
+#endif
+
+	for (; i < Count; i++) {
+		if (abs((int) From[i].Red   - (int) Transparent.Red)   > Tol or
+			abs((int) From[i].Green - (int) Transparent.Green) > Tol or
+			abs((int) From[i].Blue  - (int) Transparent.Blue)  > Tol)
+		{
+			To[i] = From[i];
+		}
+	}
+}
+
+void RangedPixelToPixelCopyTransparent(
+     const BMP& From, int FromL , int FromR, int FromB, int FromT,
+     BMP& To, int ToX, int ToY,
+     RGBApixel& Transparent, int Tolerance)
+{
+	// make sure the conventions are followed
+	if (FromB < FromT)	{ int Temp = FromT; FromT = FromB; FromB = Temp; }
+
+	// make sure that the copied regions exist in both bitmaps
+	if (FromR >= abs(From.TellWidth()))	{ FromR = abs(From.TellWidth()) - 1; }
+	if (FromL < 0) { FromL = 0; }
+
+	if (FromB >= abs(From.TellHeight()))	{ FromB = abs(From.TellHeight()) - 1; }
+	if (FromT < 0) { FromT = 0; }
+
+	if (ToX + (FromR - FromL) >= abs(To.TellWidth()))  { FromR = abs(To.TellWidth()) - 1 + FromL - ToX; }
+	if (ToY + (FromB - FromT) >= abs(To.TellHeight())) { FromB = abs(To.TellHeight()) - 1 + FromT - ToY; }
+
+	int i, j;
+
+	// Pixels are stored column by column, so each column of the range is
+	// one contiguous run in both images. Overlapping copies within one
+	// image and negative destinations keep the pixel-by-pixel semantics.
+	if (&From != &To and ToX >= 0 and ToY >= 0) {
+		int Count = FromB - FromT + 1;
+		if (Count <= 0) return;
+		ParallelFor(FromL, FromR + 1, GrainFor(Count), [&](int Begin, int End) {
+			for (int i = Begin; i < End; i++) {
+				CopyTransparentRun(&From(i, FromT), &To(ToX + (i - FromL), ToY), Count,
+								   Transparent, Tolerance);
+			}
+		});
+		return;
+	}
+
+	for (j = FromT; j <= FromB; j++) {
+		for (i = FromL; i <= FromR; i++) {
+			CopyTransparentRun(&From(i, j), &To(ToX + (i - FromL), ToY + (j - FromT)), 1,
+							   Transparent, Tolerance);
+		}
+	}
+}
+
+// Exact round(a * b / 255) for 0 <= a, b <= 255.
+static inline int Mul255(int a, int b)
+{
+	int t = a * b + 128;
+	return (t + (t >> 8)) >> 8;
+}
 
-	if (IsBigEndian()) bmfh.SwitchEndianess();
+// Reciprocals used to turn premultiplied results back into straight
+// alpha: round(C * 255 / A) == (C * Table[A] + 32768) >> 16. Rounding
+// the reciprocal up keeps exact halves such as 7 * 255 / 14 rounding up.
+static const ebmpDWORD* UnpremultiplyTable(void)
+{
+	static ebmpDWORD Table[256];
+	static bool Ready = [] {
+		Table[0] = 0;
+		for (int a = 1; a < 256; a++) Table[a] = (ebmpDWORD) ((255u * 65536u + a - 1) / a);
+		return true;
+	}();
+	(void) Ready;
+	return Table;
+}
 
-	return bmfh;
+static inline void UnpremultiplyPixel(RGBApixel& P, const ebmpDWORD* Table)
+{
+	if (P.Alpha == 255) return;
+	ebmpDWORD r = Table[P.Alpha];
+	int Red   = (int) ((P.Red   * r + 32768) >> 16);
+	int Green = (int) ((P.Green * r + 32768) >> 16);
+	int Blue  = (int) ((P.Blue  * r + 32768) >> 16);
+	P.Red   = (ebmpBYTE) (Red   > 255 ? 255 : Red);
+	P.Green = (ebmpBYTE) (Green > 255 ? 255 : Green);
+	P.Blue  = (ebmpBYTE) (Blue  > 255 ? 255 : Blue);
 }
 
-BMIH GetBMIH(const string& szFileNameIn)
+// Every mode is evaluated on premultiplied values, channel by channel,
+// with the same formula for the colour channels and for alpha.
+
+static inline int BlendChannel(int s, int d, int as, int ad, BlendMode Mode)
 {
-	BMFH bmfh;
-	BMIH bmih;
+	int o = 0;
+	switch (Mode) {
+		case BlendMode::Over:     o = s + Mul255(d, 255 - as); break;
+		case BlendMode::In:       o = Mul255(s, ad); break;
+		case BlendMode::Out:      o = Mul255(s, 255 - ad); break;
+		case BlendMode::Atop:     o = Mul255(s, ad) + Mul255(d, 255 - as); break;
+		case BlendMode::Add:      o = s + d; break;
+		case BlendMode::Multiply: o = Mul255(s, d) + Mul255(s, 255 - ad) + Mul255(d, 255 - as); break;
+		case BlendMode::Copy:     o = s; break;
+	}
+	return o > 255 ? 255 : o;
+}
 
-	FILE* fp = fopen(szFileNameIn.c_str(), "rb");
-	if (not fp) {
-		if (g_exceptions) {
-			throw runtime_error("EasyBMP::GetBMIH: cannot initialize from file " + szFileNameIn + ". "
-								"File cannot be opened or does not exist.");
+static inline void CompositePixel(const RGBApixel& From, RGBApixel& To, BlendMode Mode, bool Premultiplied)
+{
+	int s[4] = { From.Blue, From.Green, From.Red, From.Alpha };
+	int d[4] = { To.Blue, To.Green, To.Red, To.Alpha };
+	if (not Premultiplied) {
+		for (int c = 0; c < 3; c++) {
+			s[c] = Mul255(s[c], s[3]);
+			d[c] = Mul255(d[c], d[3]);
 		}
-		return bmih;
 	}
+	To.Blue  = (ebmpBYTE) BlendChannel(s[0], d[0], s[3], d[3], Mode);
+	To.Green = (ebmpBYTE) BlendChannel(s[1], d[1], s[3], d[3], Mode);
+	To.Red   = (ebmpBYTE) BlendChannel(s[2], d[2], s[3], d[3], Mode);
+	To.Alpha = (ebmpBYTE) BlendChannel(s[3], d[3], s[3], d[3], Mode);
+}
 
-	// read the bmfh, i.e., first 14 bytes (just to get it out of the way);
-
-	ebmpBYTE TempBYTE;
-	for (int i = 14; i > 0; i--) fread((char*) &TempBYTE, sizeof(ebmpBYTE), 1, fp);
-
-	// read the bmih
-
-	fread((char*) &(bmih.biSize), sizeof(ebmpDWORD), 1, fp);
-	fread((char*) &(bmih.biWidth), sizeof(ebmpDWORD), 1, fp);
-	fread((char*) &(bmih.biHeight), sizeof(ebmpDWORD), 1, fp);
-	fread((char*) &(bmih.biPlanes), sizeof(ebmpWORD), 1, fp);
-
-	fread((char*) &(bmih.biBitCount), sizeof(ebmpWORD), 1, fp);
-	fread((char*) &(bmih.biCompression), sizeof(ebmpDWORD), 1, fp);
-	fread((char*) &(bmih.biSizeImage), sizeof(ebmpDWORD), 1, fp);
-	fread((char*) &(bmih.biXPelsPerMeter), sizeof(ebmpDWORD), 1, fp);
-
-	fread((char*) &(bmih.biYPelsPerMeter), sizeof(ebmpDWORD), 1, fp);
-	fread((char*) &(bmih.biClrUsed), sizeof(ebmpDWORD), 1, fp);
-	fread((char*) &(bmih.biClrImportant), sizeof(ebmpDWORD), 1, fp);
+#ifdef EasyBMP_SSE2
 
-	fclose(fp);
+static inline __m128i Mul255x8(__m128i a, __m128i b)
+{
+	__m128i t = _mm_add_epi16(_mm_mullo_epi16(a, b), _mm_set1_epi16(128));
+	return _mm_srli_epi16(_mm_add_epi16(t, _mm_srli_epi16(t, 8)), 8);
+}
 
-	if (IsBigEndian()) bmih.SwitchEndianess();
+// Two pixels held as eight 16-bit lanes (B, G, R, A, B, G, R, A).
+static inline __m128i BroadcastAlpha(__m128i p)
+{
+	p = _mm_shufflelo_epi16(p, _MM_SHUFFLE(3, 3, 3, 3));
+	return _mm_shufflehi_epi16(p, _MM_SHUFFLE(3, 3, 3, 3));
+}
 
-	return bmih;
+static inline __m128i Blend2(__m128i s, __m128i d, BlendMode Mode, bool Premultiplied)
+{
+	const __m128i v255 = _mm_set1_epi16(255);
+	const __m128i AlphaLanes = _mm_set_epi16(255, 0, 0, 0, 255, 0, 0, 0);
+
+	__m128i as = BroadcastAlpha(s);
+	__m128i ad = BroadcastAlpha(d);
+	if (not Premultiplied) {
+		s = Mul255x8(s, _mm_or_si128(as, AlphaLanes));
+		d = Mul255x8(d, _mm_or_si128(ad, AlphaLanes));
+	}
+	switch (Mode) {
+		case BlendMode::Over:
+			return _mm_add_epi16(s, Mul255x8(d, _mm_sub_epi16(v255, as)));
+		case BlendMode::In:
+			return Mul255x8(s, ad);
+		case BlendMode::Out:
+			return Mul255x8(s, _mm_sub_epi16(v255, ad));
+		case BlendMode::Atop:
+			return _mm_add_epi16(Mul255x8(s, ad), Mul255x8(d, _mm_sub_epi16(v255, as)));
+		case BlendMode::Add:
+			return _mm_add_epi16(s, d);
+		case BlendMode::Multiply:
+			return _mm_add_epi16(_mm_add_epi16(Mul255x8(s, d), Mul255x8(s, _mm_sub_epi16(v255, ad))),
+								 Mul255x8(d, _mm_sub_epi16(v255, as)));
+		case BlendMode::Copy:
+			return s;
+	}
+	return d;
 }
 
-void DisplayBitmapInfo(const string& szFileNameIn)
+#endif
+
+static void CompositeRun(const RGBApixel* From, RGBApixel* To, int Count, BlendMode Mode, bool Premultiplied)
 {
-	FILE* fp = fopen(szFileNameIn.c_str(),"rb");
-	if (not fp) {
-		if (g_exceptions) {
-			throw runtime_error("EasyBMP::DisplayBitmapInfo: cannot initialize from file " + szFileNameIn + ". "
-								"File cannot be opened or does not exist.");
-		}
+	// a straight copy needs no round trip through premultiplied alpha
+	if (Mode == BlendMode::Copy) {
+		memmove(To, From, Count * sizeof(RGBApixel));
 		return;
 	}
-	fclose(fp);
-
-	// don't duplicate work! Just use the functions from above!
-
-	BMFH bmfh = GetBMFH(szFileNameIn);
-	BMIH bmih = GetBMIH(szFileNameIn);
 
-	cout << "File information for file " << szFileNameIn
-		 << ":" << endl << endl;
+	const ebmpDWORD* Table = UnpremultiplyTable();
+	int i = 0;
 
-	cout << "BITMAPFILEHEADER:" << endl
-		 << "bfType: " << bmfh.bfType << endl
-		 << "bfSize: " << bmfh.bfSize << endl
-		 << "bfReserved1: " << bmfh.bfReserved1 << endl
-		 << "bfReserved2: " << bmfh.bfReserved2 << endl
-		 << "bfOffBits: " << bmfh.bfOffBits << endl << endl;
+#ifdef EasyBMP_SSE2
+	const __m128i vZero = _mm_setzero_si128();
+	for (; i + 4 <= Count; i += 4) {
+		__m128i s = _mm_loadu_si128((const __m128i*) (From + i));
+		__m128i d = _mm_loadu_si128((const __m128i*) (To + i));
+		__m128i Lo = Blend2(_mm_unpacklo_epi8(s, vZero), _mm_unpacklo_epi8(d, vZero), Mode, Premultiplied);
+		__m128i Hi = Blend2(_mm_unpackhi_epi8(s, vZero), _mm_unpackhi_epi8(d, vZero), Mode, Premultiplied);
+		_mm_storeu_si128((__m128i*) (To + i), _mm_packus_epi16(Lo, Hi));
+		if (not Premultiplied) {
+			for (int k = i; k < i + 4; k++) UnpremultiplyPixel(To[k], Table);
+		}
+	}
+#endif
 
-	cout << "BITMAPINFOHEADER:" << endl
-		 << "biSize: " << bmih.biSize << endl
-		 << "biWidth: " << (int) bmih.biWidth << endl
-		 << "biHeight: " << (int) bmih.biHeight << endl
-		 << "biPlanes: " << bmih.biPlanes << endl
-		 << "biBitCount: " << bmih.biBitCount << endl
-		 << "biCompression: " << bmih.biCompression << endl
-		 << "biSizeImage: " << bmih.biSizeImage << endl
-		 << "biXPelsPerMeter: " << bmih.biXPelsPerMeter << endl
-		 << "biYPelsPerMeter: " << bmih.biYPelsPerMeter << endl
-		 << "biClrUsed: " << bmih.biClrUsed << endl
-		 << "biClrImportant: " << bmih.biClrImportant << endl << endl;
+	for (; i < Count; i++) {
+		CompositePixel(From[i], To[i], Mode, Premultiplied);
+		if (not Premultiplied) UnpremultiplyPixel(To[i], Table);
+	}
 }
 
-int GetBitmapColorDepth(const string& szFileNameIn)
+// Whether the Width x Height corners of two views span overlapping memory;
+// copies between views that may overlap keep their column order.
+
+static bool MayOverlap(const BMPView& A, const BMPView& B, int Width, int Height)
 {
-	BMIH bmih = GetBMIH(szFileNameIn);
-	return (int) bmih.biBitCount;
+	auto Span = [Width, Height](const BMPView& V, const RGBApixel*& Low, const RGBApixel*& High) {
+		const RGBApixel* Corners[4] = { &V(0, 0), &V(Width - 1, 0), &V(0, Height - 1), &V(Width - 1, Height - 1) };
+		Low = High = Corners[0];
+		for (auto Corner : Corners) { Low = min(Low, Corner); High = max(High, Corner); }
+	};
+	const RGBApixel *LowA, *HighA, *LowB, *HighB;
+	Span(A, LowA, HighA);
+	Span(B, LowB, HighB);
+	return LowA <= HighB and LowB <= HighA;
 }
 
-void PixelToPixelCopy(BMP& From, int FromX, int FromY,
-                      BMP& To, int ToX, int ToY)
+void ViewToViewCopy(const BMPView& From, const BMPView& To)
 {
-	To(ToX,ToY) = From(FromX,FromY);
+	int Width = min(From.Width, To.Width);
+	int Height = min(From.Height, To.Height);
+	if (Width <= 0 or Height <= 0) return;
+
+	auto CopyColumns = [&](int Begin, int End) {
+		for (int i = Begin; i < End; i++) {
+			if (From.RowStride == 1 and To.RowStride == 1) {
+				memmove(&To(i, 0), &From(i, 0), Height * sizeof(RGBApixel));
+				continue;
+			}
+			for (int j = 0; j < Height; j++) To(i, j) = From(i, j);
+		}
+	};
+	if (MayOverlap(From, To, Width, Height)) CopyColumns(0, Width);
+	else ParallelFor(0, Width, GrainFor(Height), CopyColumns);
 }
 
-void PixelToPixelCopyTransparent(BMP& From, int FromX, int FromY,
-                                 BMP& To, int ToX, int ToY,
-                                 RGBApixel& Transparent)
+void ViewToViewCopyTransparent(const BMPView& From, const BMPView& To,
+							   RGBApixel& Transparent, int Tolerance)
 {
-	if (From(FromX,FromY).Red != Transparent.Red or
-		From(FromX,FromY).Green != Transparent.Green or
-		From(FromX,FromY).Blue != Transparent.Blue)
-	{
-		To(ToX,ToY) = From(FromX,FromY);
-	}
+	int Width = min(From.Width, To.Width);
+	int Height = min(From.Height, To.Height);
+	if (Width <= 0 or Height <= 0) return;
+
+	auto CopyColumns = [&](int Begin, int End) {
+		for (int i = Begin; i < End; i++) {
+			if (From.RowStride == 1 and To.RowStride == 1) {
+				CopyTransparentRun(&From(i, 0), &To(i, 0), Height, Transparent, Tolerance);
+				continue;
+			}
+			for (int j = 0; j < Height; j++) {
+				CopyTransparentRun(&From(i, j), &To(i, j), 1, Transparent, Tolerance);
+			}
+		}
+	};
+	if (MayOverlap(From, To, Width, Height)) CopyColumns(0, Width);
+	else ParallelFor(0, Width, GrainFor(Height), CopyColumns);
 }
 
-void RangedPixelToPixelCopy(BMP& From, int FromL , int FromR, int FromB, int FromT,
-                            BMP& To, int ToX, int ToY )
+// Clips a source rectangle and its destination offset so the region
+// exists in both bitmaps, including negative destination offsets.
+// Returns false if nothing is left to copy.
+
+static bool ClipRange(const BMP& From, int& FromL, int& FromR, int& FromB, int& FromT,
+					  const BMP& To, int& ToX, int& ToY)
 {
 	// make sure the conventions are followed
-	if (FromB < FromT )
-	{ int Temp = FromT; FromT = FromB; FromB = Temp; }
+	if (FromB < FromT) { int Temp = FromT; FromT = FromB; FromB = Temp; }
 
 	// make sure that the copied regions exist in both bitmaps
-	if (FromR >= abs(From.TellWidth())) FromR = abs(From.TellWidth()) - 1;
-	if (FromL < 0) FromL = 0;
+	if (ToX < 0) { FromL -= ToX; ToX = 0; }
+	if (ToY < 0) { FromT -= ToY; ToY = 0; }
 
-	if (FromB >= abs(From.TellHeight())) FromB = abs(From.TellHeight()) - 1;
-	if (FromT < 0) FromT = 0;
+	if (FromR >= From.AbsWidth()) { FromR = From.AbsWidth() - 1; }
+	if (FromL < 0) { ToX -= FromL; FromL = 0; }
 
-	if (ToX + (FromR - FromL) >= abs(To.TellWidth()))  FromR = abs(To.TellWidth())  - 1 + FromL - ToX;
-	if (ToY + (FromB - FromT) >= abs(To.TellHeight())) FromB = abs(To.TellHeight()) - 1 + FromT - ToY;
+	if (FromB >= From.AbsHeight()) { FromB = From.AbsHeight() - 1; }
+	if (FromT < 0) { ToY -= FromT; FromT = 0; }
 
-	int i, j;
-	for (j = FromT; j <= FromB; j++) {
-		for (i = FromL; i <= FromR; i++) {
-			PixelToPixelCopy(From, i, j,
-							 To, ToX + (i - FromL), ToY + (j - FromT));
-		}
-	}
+	if (ToX + (FromR - FromL) >= To.AbsWidth())  { FromR = To.AbsWidth() - 1 + FromL - ToX; }
+	if (ToY + (FromB - FromT) >= To.AbsHeight()) { FromB = To.AbsHeight() - 1 + FromT - ToY; }
+
+	return FromR >= FromL and FromB >= FromT;
 }
 
-void RangedPixelToPixelCopyTransparent(
-     BMP& From, int FromL , int FromR, int FromB, int FromT,
+void RangedPixelToPixelComposite(
+     const BMP& From, int FromL , int FromR, int FromB, int FromT,
      BMP& To, int ToX, int ToY,
-     RGBApixel& Transparent)
+     BlendMode Mode, bool Premultiplied)
 {
-	// make sure the conventions are followed
-	if (FromB < FromT)	{ int Temp = FromT; FromT = FromB; FromB = Temp; }
+	if (not ClipRange(From, FromL, FromR, FromB, FromT, To, ToX, ToY)) return;
+
+	int Columns = FromR - FromL + 1;
+	int Count = FromB - FromT + 1;
+
+	// Each column is a contiguous run, so bands of columns can be blended
+	// independently. When compositing an image onto itself, snapshot the
+	// source first so bands never read pixels another band has written.
+	ScratchVector<RGBApixel> Snapshot;
+	if (&From == &To) {
+		Snapshot.resize((size_t) Columns * Count);
+		for (int i = 0; i < Columns; i++) {
+			memcpy(&Snapshot[(size_t) i * Count], &From(FromL + i, FromT), Count * sizeof(RGBApixel));
+		}
+	}
 
-	// make sure that the copied regions exist in both bitmaps
-	if (FromR >= abs(From.TellWidth()))	{ FromR = abs(From.TellWidth()) - 1; }
-	if (FromL < 0) { FromL = 0; }
+	vector<const RGBApixel*> Sources(Columns);
+	vector<RGBApixel*> Targets(Columns);
+	for (int i = 0; i < Columns; i++) {
+		Sources[i] = Snapshot.empty() ? &From(FromL + i, FromT) : &Snapshot[(size_t) i * Count];
+		Targets[i] = &To(ToX + i, ToY);
+	}
 
-	if (FromB >= abs(From.TellHeight()))	{ FromB = abs(From.TellHeight()) - 1; }
-	if (FromT < 0) { FromT = 0; }
+	ParallelFor(0, Columns, GrainFor(Count), [&](int Begin, int End) {
+		for (int i = Begin; i < End; i++) {
+			CompositeRun(Sources[i], Targets[i], Count, Mode, Premultiplied);
+		}
+	});
+}
 
-	if (ToX + (FromR - FromL) >= abs(To.TellWidth()))  { FromR = abs(To.TellWidth()) - 1 + FromL - ToX; }
-	if (ToY + (FromB - FromT) >= abs(To.TellHeight())) { FromB = abs(To.TellHeight()) - 1 + FromT - ToY; }
+CompositeLayer::CompositeLayer(BMP& From, int FromL, int FromR, int FromB, int FromT,
+							   int ToX, int ToY, BlendMode Mode, bool Premultiplied)
+	: Source(&From), FromL(FromL), FromR(FromR), FromB(FromB), FromT(FromT),
+	  ToX(ToX), ToY(ToY), Mode(Mode), Premultiplied(Premultiplied),
+	  ColorKeyed(false), Transparent(), Tolerance(0)
+{
+}
 
-	int i, j;
-	for (j = FromT; j <= FromB; j++) {
-		for (i = FromL; i <= FromR; i++) {
-			PixelToPixelCopyTransparent(From, i, j,
-										To, ToX + (i - FromL), ToY + (j - FromT),
-										Transparent);
+CompositeLayer::CompositeLayer(BMP& From, int FromL, int FromR, int FromB, int FromT,
+							   int ToX, int ToY, RGBApixel Transparent, int Tolerance)
+	: Source(&From), FromL(FromL), FromR(FromR), FromB(FromB), FromT(FromT),
+	  ToX(ToX), ToY(ToY), Mode(BlendMode::Copy), Premultiplied(false),
+	  ColorKeyed(true), Transparent(Transparent), Tolerance(Tolerance)
+{
+}
+
+void FlattenLayers(BMP& To, const vector<CompositeLayer>& Layers)
+{
+	// a tile of 32 columns by 128 rows is 16 KiB, which stays in L1
+	const int TileWidth = 32;
+	const int TileHeight = 128;
+
+	// clip every layer once, up front, into destination coordinates
+	struct ClippedLayer {
+		const CompositeLayer* Layer;
+		int FromL, FromT;
+		int X0, X1, Y0, Y1;
+	};
+	vector<ClippedLayer> Clipped;
+	for (const CompositeLayer& Layer : Layers) {
+		int FromL = Layer.FromL, FromR = Layer.FromR, FromB = Layer.FromB, FromT = Layer.FromT;
+		int ToX = Layer.ToX, ToY = Layer.ToY;
+		if (not ClipRange(*Layer.Source, FromL, FromR, FromB, FromT, To, ToX, ToY)) continue;
+		ClippedLayer c = { &Layer, FromL, FromT, ToX, ToX + FromR - FromL, ToY, ToY + FromB - FromT };
+		Clipped.push_back(c);
+	}
+	if (Clipped.empty()) return;
+
+	// a layer that reads from the destination itself must see it as it
+	// was before flattening started
+	unique_ptr<BMP> Snapshot;
+	vector<const BMP*> Sources;
+	for (const ClippedLayer& c : Clipped) {
+		const BMP* Source = c.Layer->Source;
+		if (Source == &To) {
+			if (not Snapshot) Snapshot.reset(new BMP(To));
+			Source = Snapshot.get();
 		}
-	}
+		Sources.push_back(Source);
+	}
+
+	int Width = To.AbsWidth();
+	int Height = To.AbsHeight();
+	int TileColumns = (Width + TileWidth - 1) / TileWidth;
+
+	ParallelFor(0, TileColumns, GrainFor((long long) TileWidth * Height * Clipped.size()), [&](int Begin, int End) {
+		for (int tx = Begin; tx < End; tx++) {
+			int X0 = tx * TileWidth;
+			int X1 = min(X0 + TileWidth, Width) - 1;
+			for (int Y0 = 0; Y0 < Height; Y0 += TileHeight) {
+				int Y1 = min(Y0 + TileHeight, Height) - 1;
+				for (size_t n = 0; n < Clipped.size(); n++) {
+					const ClippedLayer& c = Clipped[n];
+					int L = max(X0, c.X0), R = min(X1, c.X1);
+					int T = max(Y0, c.Y0), B = min(Y1, c.Y1);
+					if (L > R or T > B) continue;
+					int Count = B - T + 1;
+					for (int x = L; x <= R; x++) {
+						const RGBApixel* Src = &(*Sources[n])(c.FromL + x - c.X0, c.FromT + T - c.Y0);
+						RGBApixel* Dst = &To(x, T);
+						if (c.Layer->ColorKeyed) {
+							CopyTransparentRun(Src, Dst, Count, c.Layer->Transparent, c.Layer->Tolerance);
+						}
+						else {
+							CompositeRun(Src, Dst, Count, c.Layer->Mode, c.Layer->Premultiplied);
+						}
+					}
+				}
+			}
+		}
+	});
 }
 
 bool CreateGrayscaleColorTable( BMP& InputImage )
@@ -1342,136 +3433,67 @@ bool CreateGrayscaleColorTable( BMP& InputImage )
 	return true;
 }
 
-bool BMP::Read32bitRow(ebmpBYTE* Buffer, int BufferSize, int Row)
-{
-	if (Width * 4 > BufferSize) return false;
-
-	for (int i = 0; i < Width; i++) {
-		int x = HorizontalFlip ? Width -1 -i : i;
-		memcpy((char*) &(Pixels[x][Row]), (char*) Buffer+4 * i, 4);
-	}
-	return true;
-}
-
-bool BMP::Read24bitRow( ebmpBYTE* Buffer, int BufferSize, int Row )
-{
-	if (Width * 3 > BufferSize) return false;
-
-	for (int i = 0; i < Width; i++) {
-		int x = HorizontalFlip ? Width -1 -i : i;
-		memcpy((char*) &(Pixels[x][Row]), Buffer + 3 * i, 3);
-	}
-	return true;
-}
-
-bool BMP::Read8bitRow(ebmpBYTE* Buffer, int BufferSize, int Row)
-{
-	if (Width > BufferSize) return false;
-
-	for (int i = 0; i < Width; i++) {
-		int Index = Buffer[i];
-		int x = HorizontalFlip ? Width -1 -i : i;
-		RGBApixel p = GetColor(Index);
-		this->operator()(x,Row) = p;
-	}
-	return true;
-}
-
-bool BMP::Read4bitRow(ebmpBYTE* Buffer, int BufferSize, int Row)
+bool BMP::Write32bitRow(const BMPView& Source, ebmpBYTE* Buffer, size_t BufferSize, int Row)
 {
-	int Shifts[2] = {   4,  0 };
-	int Masks[2]  = { 240, 15 };
+	if ((size_t) Source.Width * 4 > BufferSize) return false;
 
-	int i = 0;
-	int j;
-	int k = 0;
-
-	if (Width > 2 * BufferSize) return false;
-	while (i < Width) {
-		j = 0;
-		while (j < 2 and i < Width) {
-			int Index = (int) ((Buffer[k] & Masks[j]) >> Shifts[j]);
-			int x = HorizontalFlip ? Width -1 -i : i;
-			this->operator()(x, Row) = GetColor(Index);
-			i++; j++;
-		}
-		k++;
-	}
-	return true;
-}
-
-bool BMP::Read1bitRow(ebmpBYTE* Buffer, int BufferSize, int Row)
-{
-	int Shifts[8] = {  7,  6,  5,  4, 3, 2, 1, 0};
-	int Masks[8]  = {128, 64, 32, 16, 8, 4, 2, 1};
-
-	int i = 0;
-	int j;
-	int k = 0;
-
-	if (Width > 8 * BufferSize) return false;
-	while (i < Width) {
-		j = 0;
-		while (j < 8 and i < Width) {
-			int Index = (int) ((Buffer[k] & Masks[j]) >> Shifts[j]);
-			int x = HorizontalFlip ? Width -1 -i : i;
-			this->operator()(x,Row) = GetColor(Index);
-			i++; j++;
-		}
-		k++;
+	for (int i = 0; i < Source.Width; i++) {
+		int col = HorizontalFlip ? Source.Width -1 -i : i;
+		memcpy((char*) Buffer + 4 * (size_t) col, (char*) &(Source(col, Row)), 4);
 	}
 	return true;
 }
 
-bool BMP::Write32bitRow(ebmpBYTE* Buffer, int BufferSize, int Row)
+bool BMP::Write24bitRow(const BMPView& Source, ebmpBYTE* Buffer, size_t BufferSize, int Row)
 {
-	if (Width * 4 > BufferSize) return false;
+	if ((size_t) Source.Width * 3 > BufferSize) return false;
 
-	for (int i = 0; i < Width; i++) {
-		int col = HorizontalFlip ? Width -1 -i : i;
-		memcpy((char*) Buffer + 4 * col, (char*) &(Pixels[col][Row]), 4);
+	for (int i = 0; i < Source.Width; i++) {
+		int col = HorizontalFlip ? Source.Width -1 -i : i;
+		memcpy((char*) Buffer + 3 * (size_t) col, (char*) &(Source(col, Row)), 3);
 	}
 	return true;
 }
 
-bool BMP::Write24bitRow(ebmpBYTE* Buffer, int BufferSize, int Row)
+bool BMP::Write16bitRow(const BMPView& Source, ebmpBYTE* Buffer, size_t BufferSize, int Row)
 {
-	if (Width * 3 > BufferSize) return false;
+	if ((size_t) Source.Width * 2 > BufferSize) return false;
 
-	for (int i = 0; i < Width; i++) {
-		int col = HorizontalFlip ? Width -1 -i : i;
-		memcpy((char*) Buffer + 3 * col, (char*) &(Pixels[col][Row]), 3);
+	for (int i = 0; i < Source.Width; i++) {
+		int col = HorizontalFlip ? Source.Width -1 -i : i;
+		const RGBApixel& P = Source(col, Row);
+		PutWORD(Buffer + 2 * (size_t) i, (ebmpWORD) (((P.Red >> 3) << 11) | ((P.Green >> 2) << 5) | (P.Blue >> 3)));
 	}
 	return true;
 }
 
-bool BMP::Write8bitRow(  ebmpBYTE* Buffer, int BufferSize, int Row )
+bool BMP::Write8bitRow(const BMPView& Source, ebmpBYTE* Buffer, size_t BufferSize, int Row)
 {
-	if (Width > BufferSize) return false;
+	if ((size_t) Source.Width > BufferSize) return false;
 
-	for (int i = 0; i < Width; i++)
+	for (int i = 0; i < Source.Width; i++)
 	{
-		int col = HorizontalFlip ? Width -1 -i : i;
-		ebmpBYTE d = FindClosestColor(Pixels[col][Row]);
+		int col = HorizontalFlip ? Source.Width -1 -i : i;
+		ebmpBYTE d = FindClosestColor(Source(col, Row));
 		Buffer[i] = d;
 	}
 	return true;
 }
 
-bool BMP::Write4bitRow(ebmpBYTE* Buffer, int BufferSize, int Row)
+bool BMP::Write4bitRow(const BMPView& Source, ebmpBYTE* Buffer, size_t BufferSize, int Row)
 {
-	if (Width > 2 * BufferSize) return false;
+	if ((size_t) Source.Width > 2 * BufferSize) return false;
 
 	static int PositionWeights[2] = { 16, 1 };
 
 	int i = 0, j, k = 0;
 
-	while (i < Width) {
+	while (i < Source.Width) {
 		j = 0;
 		int Index = 0;
-		int col = HorizontalFlip ? Width -1 -i : i;
-		while (j < 2 and i < Width) {
-			Index += (PositionWeights[j] * (int) FindClosestColor(Pixels[col][Row]));
+		int col = HorizontalFlip ? Source.Width -1 -i : i;
+		while (j < 2 and i < Source.Width) {
+			Index += (PositionWeights[j] * (int) FindClosestColor(Source(col, Row)));
 			i++; j++;
 		}
 		Buffer[k] = (ebmpBYTE) Index;
@@ -1480,20 +3502,20 @@ bool BMP::Write4bitRow(ebmpBYTE* Buffer, int BufferSize, int Row)
 	return true;
 }
 
-bool BMP::Write1bitRow(ebmpBYTE* Buffer, int BufferSize, int Row)
+bool BMP::Write1bitRow(const BMPView& Source, ebmpBYTE* Buffer, size_t BufferSize, int Row)
 {
 	static int PositionWeights[8] = { 128, 64, 32, 16, 8, 4, 2, 1 };
 
-	if (Width > 8 * BufferSize) return false;
+	if ((size_t) Source.Width > 8 * BufferSize) return false;
 
 	int i = 0, j, k = 0;
 
-	while (i < Width) {
+	while (i < Source.Width) {
 		j = 0;
 		int Index = 0;
-		int col = HorizontalFlip ? Width -1 -i : i;
-		while (j < 8 and i < Width) {
-			Index += (PositionWeights[j] * (int) FindClosestColor( Pixels[col][Row] ));
+		int col = HorizontalFlip ? Source.Width -1 -i : i;
+		while (j < 8 and i < Source.Width) {
+			Index += (PositionWeights[j] * (int) FindClosestColor( Source(col, Row) ));
 			i++; j++;
 		}
 		Buffer[k] = (ebmpBYTE) Index;
@@ -1502,7 +3524,7 @@ bool BMP::Write1bitRow(ebmpBYTE* Buffer, int BufferSize, int Row)
 	return true;
 }
 
-ebmpBYTE BMP::FindClosestColor(RGBApixel& input)
+ebmpBYTE BMP::FindClosestColor(const RGBApixel& input) const
 {
 	int NumberOfColors = TellNumberOfColors();
 	ebmpBYTE BestI = 0;
@@ -1552,10 +3574,23 @@ bool EasyBMPcheckDataSize(void)
 }
 
 bool Rescale(BMP& InputImage, char mode, int NewDimension)
+{
+	// read the old pixels in place where they are one block, rather than
+	// have the view copy what OldImage shares with InputImage
+	BMP OldImage(InputImage);
+	BMPView From((const BMP&) OldImage);
+	if (not From.Origin) From = BMPView(OldImage);
+	return Rescale(From, InputImage, mode, NewDimension);
+}
+
+bool Rescale(const BMPView& From, BMP& InputImage, char mode, int NewDimension)
 {
 	int CapMode = toupper(mode);
 
-	BMP OldImage(InputImage);
+	// samples at the edges are clamped to the view, as BMP::operator() does
+	auto OldImage = [&From](int i, int j) -> const RGBApixel& {
+		return From(max(0, min(i, From.Width - 1)), max(0, min(j, From.Height - 1)));
+	};
 
 	if (CapMode != 'P' and
 		CapMode != 'W' and
@@ -1571,8 +3606,14 @@ bool Rescale(BMP& InputImage, char mode, int NewDimension)
 	int NewWidth  = 0;
 	int NewHeight = 0;
 
-	int OldWidth = OldImage.TellWidth();
-	int OldHeight= OldImage.TellHeight();
+	int OldWidth = From.Width;
+	int OldHeight= From.Height;
+	if (OldWidth <= 0 or OldHeight <= 0) {
+		if (g_exceptions) {
+			throw invalid_argument("EasyBMP::Rescale: cannot rescale an empty view");
+		}
+		return false;
+	}
 
 	if (CapMode == 'P')	{
 		NewWidth = (int) floor( OldWidth * NewDimension / 100.0 );
@@ -1602,43 +3643,51 @@ bool Rescale(BMP& InputImage, char mode, int NewDimension)
 	InputImage.SetSize(NewWidth, NewHeight);
 	InputImage.SetBitDepth(24);
 
-	int I, J;
-	double ThetaI,ThetaJ;
-
-	for (int j = 0; j < NewHeight - 1; j++)	{
-		ThetaJ = (double)(j * (OldHeight - 1.0)) / (double)(NewHeight - 1.0);
-		J = (int) floor(ThetaJ);
-		ThetaJ -= J;
-
-		for (int i = 0; i < NewWidth - 1; i++) {
-			ThetaI = (double)(i * (OldWidth - 1.0)) / (double)(NewWidth - 1.0);
-			I = (int) floor(ThetaI);
+	// each output column depends only on the source, so columns run in
+	// parallel; the pixels are stored column after column, so each thread
+	// writes memory of its own
+	ParallelFor(0, NewWidth - 1, GrainFor(NewHeight), [&](int Begin, int End) {
+		for (int i = Begin; i < End; i++) {
+			double ThetaI = (double)(i * (OldWidth - 1.0)) / (double)(NewWidth - 1.0);
+			int I = (int) floor(ThetaI);
 			ThetaI -= I;
 
-			InputImage(i, j).Red = (ebmpBYTE)
-			( (1.0 - ThetaI - ThetaJ + ThetaI * ThetaJ) * (OldImage(I,J).Red)
-			 + (ThetaI - ThetaI * ThetaJ) * (OldImage(I+1, J).Red)
-			 + (ThetaJ - ThetaI * ThetaJ) * (OldImage(I, J+1).Red)
-			 + (ThetaI * ThetaJ) * (OldImage(I+1, J+1).Red) );
-			InputImage(i, j).Green = (ebmpBYTE)
-			( (1.0 - ThetaI - ThetaJ + ThetaI * ThetaJ) * OldImage(I,J).Green
-			 + (ThetaI - ThetaI * ThetaJ) * OldImage(I+1, J).Green
-			 + (ThetaJ - ThetaI * ThetaJ) * OldImage(I, J+1).Green
-			 + (ThetaI * ThetaJ) * OldImage(I+1, J+1).Green );
-			InputImage(i, j).Blue = (ebmpBYTE)
-			( (1.0 - ThetaI - ThetaJ + ThetaI * ThetaJ) * OldImage(I,J).Blue
-			 + (ThetaI - ThetaI * ThetaJ) * OldImage(I+1, J).Blue
-			 + (ThetaJ - ThetaI * ThetaJ) * OldImage(I, J+1).Blue
-			 + (ThetaI * ThetaJ) * OldImage(I+1, J+1).Blue );
+			for (int j = 0; j < NewHeight - 1; j++) {
+				double ThetaJ = (double)(j * (OldHeight - 1.0)) / (double)(NewHeight - 1.0);
+				int J = (int) floor(ThetaJ);
+				ThetaJ -= J;
+
+				InputImage(i, j).Red = (ebmpBYTE)
+				( (1.0 - ThetaI - ThetaJ + ThetaI * ThetaJ) * (OldImage(I,J).Red)
+				 + (ThetaI - ThetaI * ThetaJ) * (OldImage(I+1, J).Red)
+				 + (ThetaJ - ThetaI * ThetaJ) * (OldImage(I, J+1).Red)
+				 + (ThetaI * ThetaJ) * (OldImage(I+1, J+1).Red) );
+				InputImage(i, j).Green = (ebmpBYTE)
+				( (1.0 - ThetaI - ThetaJ + ThetaI * ThetaJ) * OldImage(I,J).Green
+				 + (ThetaI - ThetaI * ThetaJ) * OldImage(I+1, J).Green
+				 + (ThetaJ - ThetaI * ThetaJ) * OldImage(I, J+1).Green
+				 + (ThetaI * ThetaJ) * OldImage(I+1, J+1).Green );
+				InputImage(i, j).Blue = (ebmpBYTE)
+				( (1.0 - ThetaI - ThetaJ + ThetaI * ThetaJ) * OldImage(I,J).Blue
+				 + (ThetaI - ThetaI * ThetaJ) * OldImage(I+1, J).Blue
+				 + (ThetaJ - ThetaI * ThetaJ) * OldImage(I, J+1).Blue
+				 + (ThetaI * ThetaJ) * OldImage(I+1, J+1).Blue );
+			}
 		}
+	});
+
+	for (int j = 0; j < NewHeight - 1; j++) {
+		double ThetaJ = (double)(j * (OldHeight - 1.0)) / (double)(NewHeight - 1.0);
+		int J = (int) floor(ThetaJ);
+		ThetaJ -= J;
 		InputImage(NewWidth - 1, j).Red   = (ebmpBYTE) ((1.0 - ThetaJ) * (OldImage(OldWidth - 1, J).Red)   + ThetaJ * (OldImage(OldWidth-1, J+1).Red));
 		InputImage(NewWidth - 1, j).Green = (ebmpBYTE)	((1.0 - ThetaJ) * (OldImage(OldWidth - 1, J).Green) + ThetaJ * (OldImage(OldWidth-1, J+1).Green));
 		InputImage(NewWidth - 1, j).Blue  = (ebmpBYTE) ((1.0 - ThetaJ) * (OldImage(OldWidth - 1, J).Blue)  + ThetaJ * (OldImage(OldWidth-1, J+1).Blue));
 	}
 
 	for (int i = 0; i < NewWidth-1 ; i++) {
-		ThetaI = (double)(i * (OldWidth - 1.0)) / (double)(NewWidth - 1.0);
-		I = (int) floor(ThetaI);
+		double ThetaI = (double)(i * (OldWidth - 1.0)) / (double)(NewWidth - 1.0);
+		int I = (int) floor(ThetaI);
 		ThetaI -= I;
 		InputImage(i, NewHeight - 1).Red   = (ebmpBYTE) ((1.0 - ThetaI) * (OldImage(I, OldHeight - 1).Red)   + ThetaI * (OldImage(I, OldHeight - 1).Red));
 		InputImage(i, NewHeight - 1).Green = (ebmpBYTE) ((1.0 - ThetaI) * (OldImage(I, OldHeight - 1).Green) + ThetaI * (OldImage(I, OldHeight - 1).Green));
@@ -1648,3 +3697,152 @@ bool Rescale(BMP& InputImage, char mode, int NewDimension)
 	InputImage(NewWidth - 1, NewHeight - 1) = OldImage(OldWidth - 1, OldHeight - 1);
 	return true;
 }
+
+// Copies the block [X0, X1) x [Y0, Y1) of the source into the transposed
+// position of the destination, optionally mirroring the destination
+// columns (Rotate90) or rows (Rotate270). Full 4x4 blocks are transposed
+// in registers: four source column segments in, four destination column
+// segments out.
+
+static void TransposeBlock(const RGBApixel* const* Src, RGBApixel* const* Dst,
+						   int X0, int X1, int Y0, int Y1, int Width, int Height,
+						   bool FlipColumns, bool FlipRows)
+{
+	int x = X0;
+#ifdef EasyBMP_SSE2
+	for (; x + 4 <= X1; x += 4) {
+		int y = Y0;
+		for (; y + 4 <= Y1; y += 4) {
+			__m128i r0 = _mm_loadu_si128((const __m128i*) (Src[x]     + y));
+			__m128i r1 = _mm_loadu_si128((const __m128i*) (Src[x + 1] + y));
+			__m128i r2 = _mm_loadu_si128((const __m128i*) (Src[x + 2] + y));
+			__m128i r3 = _mm_loadu_si128((const __m128i*) (Src[x + 3] + y));
+			__m128i t0 = _mm_unpacklo_epi32(r0, r1);
+			__m128i t1 = _mm_unpacklo_epi32(r2, r3);
+			__m128i t2 = _mm_unpackhi_epi32(r0, r1);
+			__m128i t3 = _mm_unpackhi_epi32(r2, r3);
+			__m128i c[4] = { _mm_unpacklo_epi64(t0, t1), _mm_unpackhi_epi64(t0, t1),
+							 _mm_unpacklo_epi64(t2, t3), _mm_unpackhi_epi64(t2, t3) };
+			int Row = FlipRows ? Width - 4 - x : x;
+			for (int k = 0; k < 4; k++) {
+				int Column = FlipColumns ? Height - 1 - (y + k) : y + k;
+				__m128i v = FlipRows ? _mm_shuffle_epi32(c[k], _MM_SHUFFLE(0, 1, 2, 3)) : c[k];
+				_mm_storeu_si128((__m128i*) (Dst[Column] + Row), v);
+			}
+		}
+		for (; y < Y1; y++) {
+			int Column = FlipColumns ? Height - 1 - y : y;
+			for (int k = x; k < x + 4; k++) {
+				Dst[Column][FlipRows ? Width - 1 - k : k] = Src[k][y];
+			}
+		}
+	}
+#endif
+	for (; x < X1; x++) {
+		int Row = FlipRows ? Width - 1 - x : x;
+		for (int y = Y0; y < Y1; y++) {
+			Dst[FlipColumns ? Height - 1 - y : y][Row] = Src[x][y];
+		}
+	}
+}
+
+bool TransposedCopy(BMP& From, BMP& To, bool FlipColumns, bool FlipRows)
+{
+	// rotating an image onto itself needs a private copy of the source
+	unique_ptr<BMP> Snapshot;
+	const BMP* Source = &From;
+	if (&From == &To) {
+		Snapshot.reset(new BMP(From));
+		Source = Snapshot.get();
+	}
+
+	int Width = Source->AbsWidth();
+	int Height = Source->AbsHeight();
+	int XPels = Source->XPelsPerMeter;
+	int YPels = Source->YPelsPerMeter;
+
+	if (not To.SetBitDepth(Source->TellBitDepth())) return false;
+	if (To.TellBitDepth() == 1 or To.TellBitDepth() == 4 or To.TellBitDepth() == 8) {
+		for (int k = 0; k < To.TellNumberOfColors(); k++) To.SetColor(k, Source->GetColor(k));
+	}
+	if (not To.SetSize(Height, Width)) return false;
+	To.XPelsPerMeter = YPels;
+	To.YPelsPerMeter = XPels;
+
+	vector<const RGBApixel*> Src(Width);
+	vector<RGBApixel*> Dst(Height);
+	for (int i = 0; i < Width; i++)  Src[i] = &(*Source)(i, 0);
+	for (int j = 0; j < Height; j++) Dst[j] = &To(j, 0);
+
+	// 64x64 pixel blocks: 16 KiB read and 16 KiB written per block
+	const int Block = 64;
+	int BlockColumns = (Width + Block - 1) / Block;
+	ParallelFor(0, BlockColumns, GrainFor((long long) Block * Height), [&](int Begin, int End) {
+		for (int bx = Begin; bx < End; bx++) {
+			int X0 = bx * Block, X1 = min(X0 + Block, Width);
+			for (int Y0 = 0; Y0 < Height; Y0 += Block) {
+				TransposeBlock(Src.data(), Dst.data(), X0, X1, Y0, min(Y0 + Block, Height),
+							   Width, Height, FlipColumns, FlipRows);
+			}
+		}
+	});
+	return true;
+}
+
+bool Transpose(BMP& From, BMP& To)
+{
+	return TransposedCopy(From, To, false, false);
+}
+
+bool Rotate90(BMP& From, BMP& To)
+{
+	return TransposedCopy(From, To, true, false);
+}
+
+bool Rotate270(BMP& From, BMP& To)
+{
+	return TransposedCopy(From, To, false, true);
+}
+
+// Swaps each pixel with its mirror through the centre; column i is
+// exchanged, reversed, with column Width-1-i.
+
+static void SwapReversedRuns(RGBApixel* A, RGBApixel* B, int Count)
+{
+	int i = 0;
+#ifdef EasyBMP_SSE2
+	for (; i + 4 <= Count; i += 4) {
+		__m128i a = _mm_loadu_si128((const __m128i*) (A + i));
+		__m128i b = _mm_loadu_si128((const __m128i*) (B + Count - 4 - i));
+		_mm_storeu_si128((__m128i*) (A + i), _mm_shuffle_epi32(b, _MM_SHUFFLE(0, 1, 2, 3)));
+		_mm_storeu_si128((__m128i*) (B + Count - 4 - i), _mm_shuffle_epi32(a, _MM_SHUFFLE(0, 1, 2, 3)));
+	}
+#endif
+	for (; i < Count; i++) {
+		RGBApixel Temp = A[i];
+		A[i] = B[Count - 1 - i];
+		B[Count - 1 - i] = Temp;
+	}
+}
+
+bool Rotate180(BMP& Image)
+{
+	int Width = Image.AbsWidth();
+	int Height = Image.AbsHeight();
+
+	ParallelFor(0, Width / 2, GrainFor(Height), [&](int Begin, int End) {
+		for (int i = Begin; i < End; i++) {
+			SwapReversedRuns(&Image(i, 0), &Image(Width - 1 - i, 0), Height);
+		}
+	});
+
+	if (Width % 2) {
+		RGBApixel* Middle = &Image(Width / 2, 0);
+		for (int j = 0; j < Height / 2; j++) {
+			RGBApixel Temp = Middle[j];
+			Middle[j] = Middle[Height - 1 - j];
+			Middle[Height - 1 - j] = Temp;
+		}
+	}
+	return true;
+}
@@ -30,7 +30,10 @@
 #include <iostream>
 #include <cmath>
 #include <cctype>
+#include <cstddef>
 #include <cstring>
+#include <functional>
+#include <atomic>
 #include <memory>
 #include <vector>
 
@@ -68,6 +71,8 @@
 #endif
 
 #include "EasyBMP_DataStructures.h"
+#include "EasyBMP_View.h"
+#include "EasyBMP_Allocator.h"
 #include "EasyBMP_BMP.h"
 #include "EasyBMP_VariousBMPutilities.h"
 
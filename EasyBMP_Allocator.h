@@ -0,0 +1,99 @@
+/*************************************************
+*                                                *
+*  EasyBMP Cross-Platform Windows Bitmap Library *
+*                                                *
+*  Author: Paul Macklin                          *
+*   email: macklin01@users.sourceforge.net       *
+* support: http://easybmp.sourceforge.net        *
+*                                                *
+*          file: EasyBMP_Allocator.h             *
+*    date added: 10-19-2026                      *
+* date modified: 10-19-2026                      *
+*       version: 1.06                            *
+*                                                *
+*   License: BSD (revised/modified)              *
+* Copyright: 2005-6 by the EasyBMP Project       *
+*                                                *
+* description: Defines where pixel memory comes  *
+*              from                              *
+*                                                *
+*************************************************/
+
+#ifndef _EasyBMP_Allocator_h_
+#define _EasyBMP_Allocator_h_
+
+// Supplies the memory for pixel blocks and scratch rows. Blocks must be
+// aligned to at least Alignment bytes, and Allocate throws
+// std::bad_alloc when it cannot deliver. Deallocate gets back the size
+// that was asked for. An allocator may be used from several threads at
+// once.
+
+class BMPAllocator {
+public:
+ static const std::size_t Alignment = 64;
+
+ virtual ~BMPAllocator() {}
+ virtual void* Allocate(std::size_t Size) = 0;
+ virtual void Deallocate(void* Block, std::size_t Size) = 0;
+
+ // The library's own allocator: freed blocks are kept by size class and
+ // handed out again, so images of similar sizes recycle their memory.
+ static BMPAllocator& Pooled(void);
+};
+
+// A BMPArena hands out memory by bumping a pointer through large chunks
+// taken from Upstream, and gives nothing back until Release() or its
+// destruction. It suits batch jobs that decode many images and drop them
+// together: images built with BMP(Arena), and copies of them, cost no
+// per-image frees. The arena must outlive its images, though Release()
+// may run first as long as those images are only destroyed afterwards.
+// It is not synchronized; use one per thread.
+
+class BMPArena : public BMPAllocator {
+public:
+ explicit BMPArena(std::size_t ChunkSize = 1 << 20,
+                   BMPAllocator& Upstream = BMPAllocator::Pooled());
+ ~BMPArena();
+
+ void* Allocate(std::size_t Size);
+ void Deallocate(void*, std::size_t) {}
+
+ // returns every chunk to Upstream
+ void Release(void);
+
+ BMPArena(const BMPArena&) = delete;
+ BMPArena& operator=(const BMPArena&) = delete;
+
+private:
+ struct Chunk { void* Block; std::size_t Size; };
+ std::vector<Chunk> Chunks;
+ char* Next;
+ std::size_t Left;
+ std::size_t ChunkSize;
+ BMPAllocator* Upstream;
+};
+
+// A standard allocator over BMPAllocator::Pooled(), for scratch vectors
+// whose rows should be aligned and recycled like pixel blocks.
+
+template <class T>
+class ScratchAllocator {
+public:
+ typedef T value_type;
+
+ ScratchAllocator() {}
+ template <class U> ScratchAllocator(const ScratchAllocator<U>&) {}
+
+ T* allocate(std::size_t Count)
+ { return (T*) BMPAllocator::Pooled().Allocate(Count * sizeof(T)); }
+ void deallocate(T* Block, std::size_t Count)
+ { BMPAllocator::Pooled().Deallocate(Block, Count * sizeof(T)); }
+
+ template <class U> bool operator==(const ScratchAllocator<U>&) const { return true; }
+ template <class U> bool operator!=(const ScratchAllocator<U>&) const { return false; }
+};
+
+template <class T>
+using ScratchVector = std::vector<T, ScratchAllocator<T>>;
+
+#endif
@@ -38,39 +38,119 @@ private:
 	ebmpBYTE* MetaData2;
 	int SizeOfMetaData2;
 
-	bool Read32bitRow(ebmpBYTE* Buffer, int BufferSize, int Row);
-	bool Read24bitRow(ebmpBYTE* Buffer, int BufferSize, int Row);
-	bool Read8bitRow( ebmpBYTE* Buffer, int BufferSize, int Row);
-	bool Read4bitRow( ebmpBYTE* Buffer, int BufferSize, int Row);
-	bool Read1bitRow( ebmpBYTE* Buffer, int BufferSize, int Row);
-
-	bool Write32bitRow(ebmpBYTE* Buffer, int BufferSize, int Row);
-	bool Write24bitRow(ebmpBYTE* Buffer, int BufferSize, int Row);
-	bool Write8bitRow( ebmpBYTE* Buffer, int BufferSize, int Row);
-	bool Write4bitRow( ebmpBYTE* Buffer, int BufferSize, int Row);
-	bool Write1bitRow( ebmpBYTE* Buffer, int BufferSize, int Row);
-
-	ebmpBYTE FindClosestColor(RGBApixel& input);
+	// the bytes of a file being read, from a stream or a memory buffer
+	class ByteSource;
+	// what the headers of that file describe
+	struct FileLayout;
+
+	// where Pixels came from; fixed when the image is constructed
+	BMPAllocator* Memory;
+
+	// Images up to 16x16 keep their column table and pixels here instead
+	// of asking Memory; the slack leaves room to align the start.
+	static const size_t InlineBytes = 2 * BMPAllocator::Alignment + 16 * 16 * sizeof(RGBApixel);
+	ebmpBYTE Inline[InlineBytes + BMPAllocator::Alignment - 1];
+	ebmpBYTE* InlineStorage(void) const;
+
+	// Copies share their pixels until they write to them, a column at a
+	// time. Data is the block the columns started out in, which other
+	// images may share while Share counts them; Copies lists the columns
+	// this image has copied out of Data to write them, each allocated on
+	// its own. A column still in Data is written in place once no other
+	// image shares Data. A pinned image has a view onto its pixels, so its
+	// copies duplicate them.
+	// Share is the one field copying an image changes in the source: the
+	// first copy sets it with a compare-and-swap, so a const image may be
+	// copied from several threads at once.
+	struct PixelShare;
+	RGBApixel* Data;
+	mutable std::atomic<PixelShare*> Share;
+	std::vector<RGBApixel*> Copies;
+	bool Pinned;
+
+	void SharePixels(const BMP& Input);
+	RGBApixel* WritableColumn(int i);
+	RGBApixel* CopyColumn(int i);
+	RGBApixel* Pin(void);
+	friend class BMPView;
+	// the rotations swap the stored resolution rather than round it
+	// through SetDPI
+	friend bool TransposedCopy(BMP& From, BMP& To, bool FlipColumns, bool FlipRows);
+	void ClampPixel(int& i, int& j) const;
+
+	void AllocatePixels(int NewWidth, int NewHeight);
+	void FreePixels(void);
+	void AllocateColors(void);
+	void FreeColors(void);
+	bool ReadFromSource(ByteSource& Source);
+	BMPStatus TryReadFromSource(ByteSource& Source);
+	bool ReadPixels(ByteSource& Source, const FileLayout& Layout);
+	static bool ReadLayout(ByteSource& Source, FileLayout& Layout);
+	static bool DecodeRows(ByteSource& Source, const FileLayout& Layout,
+	                       const std::function<void(int, const RGBApixel*)>& Deliver);
+	static bool DecodeRLE(ByteSource& Source, const FileLayout& Layout,
+	                      const std::function<void(int, const RGBApixel*)>& Deliver);
+	static bool DecodeInto(ByteSource& Source, void* Target, size_t Stride,
+	                       PixelFormat Format, bool BottomUp);
+
+	bool Write32bitRow(const BMPView& Source, ebmpBYTE* Buffer, size_t BufferSize, int Row);
+	bool Write24bitRow(const BMPView& Source, ebmpBYTE* Buffer, size_t BufferSize, int Row);
+	bool Write16bitRow(const BMPView& Source, ebmpBYTE* Buffer, size_t BufferSize, int Row);
+	bool Write8bitRow( const BMPView& Source, ebmpBYTE* Buffer, size_t BufferSize, int Row);
+	bool Write4bitRow( const BMPView& Source, ebmpBYTE* Buffer, size_t BufferSize, int Row);
+	bool Write1bitRow( const BMPView& Source, ebmpBYTE* Buffer, size_t BufferSize, int Row);
+
+	// hands out row j (0 is the top) of the image being written as a
+	// one-row view
+	typedef std::function<BMPView(int)> RowSource;
+
+	void EncodeRLE(int Width, int Height, const RowSource& RowOf, ScratchVector<ebmpBYTE>& Output);
+	// serialises the rows as a complete file and passes it to Sink in as
+	// few chunks as possible; false if Sink fails
+	bool Encode(int Width, int Height, const RowSource& RowOf,
+	            const std::function<bool(const ebmpBYTE*, size_t)>& Sink);
+	RowSource Rows(void) const;
+	BMPStatus EncodeToFile(const std::string& FileName, int Width, int Height, const RowSource& RowOf);
+	BMPStatus EncodeToStream(std::ostream& out, int Width, int Height, const RowSource& RowOf);
+	bool CheckPixelBuffer(const PixelBuffer& Source, const std::string& Caller);
+	BMPView PixelBufferRow(const PixelBuffer& Source, int j);
+
+	ebmpBYTE FindClosestColor(const RGBApixel& input) const;
 
 	bool VerticalFlip{false};
 	bool HorizontalFlip{false};
+	bool RLECompression{false};
 
 public:
 
-	int TellBitDepth(void);
-	int TellWidth(void);
-	int TellHeight(void);
-	int AbsWidth(void);
-	int AbsHeight(void);
-	int TellNumberOfColors(void);
+	// The queries and pixel reads are const and have no side effects, so
+	// one image can be read from many threads at once as long as nothing
+	// modifies it meanwhile.
+	int TellBitDepth(void) const;
+	int TellWidth(void) const;
+	int TellHeight(void) const;
+	int AbsWidth(void) const;
+	int AbsHeight(void) const;
+	int TellNumberOfColors(void) const;
 	void SetDPI(int HorizontalDPI, int VerticalDPI);
-	int TellVerticalDPI(void);
-	int TellHorizontalDPI(void);
+	int TellVerticalDPI(void) const;
+	int TellHorizontalDPI(void) const;
+
+	// RLE8/RLE4 compression when writing 8-bit and 4-bit files. Off by
+	// default; reading a compressed file turns it on.
+	void SetRLECompression(bool Enable);
+	bool TellRLECompression(void) const;
 
 	BMP();
-	BMP(BMP& Input);
+	// takes its pixel memory from Allocator, which must outlive it
+	explicit BMP(BMPAllocator& Allocator);
+	// copies share pixels until either side writes to them, and take
+	// their memory from the allocator of the image they copy
+	BMP(const BMP& Input);
+	BMP& operator=(const BMP& Input);
 	~BMP();
 	RGBApixel& operator()(int i,int j);
+	const RGBApixel& operator()(int i,int j) const;
 
 	RGBApixel GetPixel(int i, int j) const;
 	bool SetPixel(int i, int j, RGBApixel NewPixel);
@@ -84,14 +164,83 @@ public:
 	bool ReadFromFile(const std::string& FileName);
 	bool ReadFromBuffer(const unsigned char* buffer, size_t size);
 
+	// Non-throwing reads and writes for bulk work on untrusted files.
+	// They never throw for a bad file, never build an error message and
+	// report the first problem found with its byte offset. If the headers
+	// are rejected the image is left as it was, which includes files,
+	// buffers and seekable streams shorter than their headers declare or
+	// too short for their uncompressed pixel data. Truncated RLE data in
+	// a file that does not declare its size, or a short non-seekable
+	// stream, leaves the rows that were never read white. On success
+	// Offset is the number of bytes read or written.
+	BMPStatus TryReadFromFile(const std::string& FileName);
+	BMPStatus TryReadFromStream(std::istream& instream);
+	BMPStatus TryReadFromBuffer(const unsigned char* buffer, size_t size);
+	BMPStatus TryWriteToFile(const std::string& FileName);
+	BMPStatus TryWriteToStream(std::ostream& outstream);
+
+	// Decode a file straight into caller memory, Stride bytes apart from
+	// one row to the next, without building a BMP. Rows are stored top
+	// row first unless BottomUp is set. ReadDimensions tells how much
+	// room that takes.
+	static bool ReadDimensions(const std::string& FileName, int& Width, int& Height);
+	static bool ReadDimensions(const unsigned char* buffer, size_t size, int& Width, int& Height);
+	static bool DecodeInto(const std::string& FileName, void* Target, size_t Stride,
+	                       PixelFormat Format, bool BottomUp = false);
+	static bool DecodeInto(const unsigned char* buffer, size_t size, void* Target, size_t Stride,
+	                       PixelFormat Format, bool BottomUp = false);
+
 	bool WriteToFile(const std::string& FileName);
+	// writes Region (usually a crop or mirror of this image) using this
+	// image's bit depth, color table and resolution
+	bool WriteToFile(const std::string& FileName, const BMPView& Region);
 	bool WriteToBuffer(unsigned char* buffer, size_t size);
-
-	RGBApixel GetColor(int ColorNumber);
+	bool WriteToStream(std::ostream& outstream);
+	bool WriteToStream(std::ostream& outstream, const BMPView& Region);
+	// write pixels straight from caller memory, using this image's bit
+	// depth, color table and resolution
+	bool WriteToFile(const std::string& FileName, const PixelBuffer& Source);
+	bool WriteToStream(std::ostream& outstream, const PixelBuffer& Source);
+
+	RGBApixel GetColor(int ColorNumber) const;
 	bool SetColor(int ColorNumber, RGBApixel NewColor);
 
+	// Whether errors throw or only make the call return false. The
+	// policy belongs to the calling thread; other threads keep their own.
 	static bool exceptions(void);
 	static void exceptions(bool flag);
+
+	// The allocator that images constructed on this thread take their
+	// pixel memory from; nullptr restores the pooled default. An image
+	// keeps the allocator it was constructed with, which must outlive it;
+	// copies keep the allocator of their source.
+	static BMPAllocator& allocator(void);
+	static void allocator(BMPAllocator* NewAllocator);
+
+	// Size limits for files being read, also per thread. Reads of files
+	// over a limit fail before any pixel memory is allocated.
+	static BMPLimits limits(void);
+	static void limits(const BMPLimits& NewLimits);
+
+	// Sets the calling thread's policy for one scope and restores the
+	// previous one on the way out, so a single call can opt out:
+	//   { BMP::ExceptionScope Quiet(false); ok = Image.ReadFromFile(Name); }
+	class ExceptionScope {
+	public:
+		explicit ExceptionScope(bool flag);
+		~ExceptionScope();
+		ExceptionScope(const ExceptionScope&) = delete;
+		ExceptionScope& operator=(const ExceptionScope&) = delete;
+	private:
+		bool Previous;
+	};
+
+	// Threads the library's parallel routines may use, the calling thread
+	// included: 0 means one per hardware thread (the default) and 1 turns
+	// threading off. Changing it waits for running work to finish, and
+	// is refused from inside a parallel loop.
+	static int threads(void);
+	static void threads(int count);
 };
 
 #endif
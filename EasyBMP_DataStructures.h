@@ -69,6 +69,46 @@ typedef struct RGBApixel {
 	ebmpBYTE Alpha;
 } RGBApixel; 
 
+// Pixel layouts BMP::DecodeInto can produce, named in memory order.
+// The four-channel layouts carry RGBApixel::Alpha through unchanged.
+enum class PixelFormat { RGB8, BGR8, RGBA8, BGRA8, Gray8 };
+
+// Why a BMP::TryRead or TryWrite call failed.
+enum class BMPError {
+	None,
+	CannotOpen,        // the file could not be opened
+	NotBMP,            // no "BM" signature
+	Truncated,         // the data ends before the headers say it should
+	UnsupportedHeader, // OS/2 and other info headers under 40 bytes
+	UnsupportedFormat, // bit depth and compression this library cannot read
+	BadDimensions,     // zero height or a width that is not positive
+	InvalidArgument,   // the caller asked for something impossible
+	WriteFailed,       // the file or stream would not take the data
+	LimitExceeded      // the file is bigger than BMP::limits() allows
+};
+
+// Caps the reader checks against the headers before it allocates
+// anything, so a small hostile file cannot claim gigabytes. MaxBytes
+// bounds the file itself: its declared size, the offset of its pixel
+// data and the size of that data. The defaults (32 megapixels, 128 MiB
+// of pixels in memory and a 256 MiB file) suit a service reading
+// uploads; raise them with BMP::limits() for bigger images.
+struct BMPLimits {
+	int MaxWidth = 1 << 16;
+	int MaxHeight = 1 << 16;
+	long long MaxPixels = 1LL << 25;
+	long long MaxBytes = 1LL << 28;
+};
+
+// What went wrong and how many bytes into the file it was noticed. It
+// converts to true on success. Building one never allocates.
+struct BMPStatus {
+	BMPError Error;
+	size_t Offset;
+
+	explicit operator bool() const { return Error == BMPError::None; }
+};
+
 class BMFH{
 public:
  ebmpWORD  bfType;
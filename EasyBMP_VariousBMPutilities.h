@@ -25,19 +25,77 @@ BMFH GetBMFH(const std::string& szFileNameIn);
 BMIH GetBMIH(const std::string& szFileNameIn);
 void DisplayBitmapInfo(const std::string& szFileNameIn);
 int GetBitmapColorDepth(const std::string& szFileNameIn);
-void PixelToPixelCopy(BMP& From, int FromX, int FromY,
+void PixelToPixelCopy(const BMP& From, int FromX, int FromY,
 					  BMP& To, int ToX, int ToY);
-void PixelToPixelCopyTransparent(BMP& From, int FromX, int FromY,
+void PixelToPixelCopyTransparent(const BMP& From, int FromX, int FromY,
 								 BMP& To, int ToX, int ToY,
 								 RGBApixel& Transparent);
-void RangedPixelToPixelCopy(BMP& From, int FromL , int FromR, int FromB, int FromT,
+void RangedPixelToPixelCopy(const BMP& From, int FromL , int FromR, int FromB, int FromT,
 							BMP& To, int ToX, int ToY);
 void RangedPixelToPixelCopyTransparent(
-     BMP& From, int FromL , int FromR, int FromB, int FromT, 
+     const BMP& From, int FromL , int FromR, int FromB, int FromT, 
      BMP& To, int ToX, int ToY,
-     RGBApixel& Transparent);
+     RGBApixel& Transparent, int Tolerance = 0);
 bool CreateGrayscaleColorTable(BMP& InputImage);
 
+// Runs Body over [Begin, End), split into contiguous chunks of at least
+// Grain items, on the library's shared thread pool (see BMP::threads).
+// Body must be safe to run on different chunks at once. It runs inline
+// when the range is one chunk, threading is off, or the call is made from
+// inside another ParallelFor.
+void ParallelFor(int Begin, int End, int Grain, const std::function<void(int, int)>& Body);
+
+// View-based copies cover the overlap of the two views' sizes.
+void ViewToViewCopy(const BMPView& From, const BMPView& To);
+void ViewToViewCopyTransparent(const BMPView& From, const BMPView& To,
+                               RGBApixel& Transparent, int Tolerance = 0);
+
+// Porter-Duff operators (plus additive and multiply blending) for
+// RangedPixelToPixelComposite. Alpha 255 is opaque and 0 is fully
+// transparent; From is the source and To is the destination.
+// Copy replaces the destination pixel outright.
+enum class BlendMode { Over, In, Out, Atop, Add, Multiply, Copy };
+
+void RangedPixelToPixelComposite(
+     const BMP& From, int FromL , int FromR, int FromB, int FromT,
+     BMP& To, int ToX, int ToY,
+     BlendMode Mode, bool Premultiplied = false);
+
+// One layer for FlattenLayers: the source rectangle, where it lands in
+// the destination and how it is blended. The second constructor makes a
+// colour-keyed layer that behaves like RangedPixelToPixelCopyTransparent.
+class CompositeLayer {
+public:
+ BMP* Source;
+ int FromL, FromR, FromB, FromT;
+ int ToX, ToY;
+ BlendMode Mode;
+ bool Premultiplied;
+ bool ColorKeyed;
+ RGBApixel Transparent;
+ int Tolerance;
+
+ CompositeLayer(BMP& From, int FromL, int FromR, int FromB, int FromT,
+                int ToX, int ToY,
+                BlendMode Mode = BlendMode::Over, bool Premultiplied = false);
+ CompositeLayer(BMP& From, int FromL, int FromR, int FromB, int FromT,
+                int ToX, int ToY,
+                RGBApixel Transparent, int Tolerance = 0);
+};
+
+// Applies all layers, in order, onto To in a single tiled pass so each
+// destination tile stays in cache while every layer is blended into it.
+void FlattenLayers(BMP& To, const std::vector<CompositeLayer>& Layers);
+
 bool Rescale(BMP& InputImage, char mode, int NewDimension);
+// To must not be the image that From looks into
+bool Rescale(const BMPView& From, BMP& To, char mode, int NewDimension);
+
+// Rotations are clockwise. Rotate180 works in place; the others write
+// an image with swapped dimensions into To, which may be From itself.
+bool Rotate90(BMP& From, BMP& To);
+bool Rotate180(BMP& Image);
+bool Rotate270(BMP& From, BMP& To);
+bool Transpose(BMP& From, BMP& To);
 
 #endif
@@ -0,0 +1,82 @@
+/*************************************************
+*                                                *
+*  EasyBMP Cross-Platform Windows Bitmap Library *
+*                                                *
+*  Author: Paul Macklin                          *
+*   email: macklin01@users.sourceforge.net       *
+* support: http://easybmp.sourceforge.net        *
+*                                                *
+*          file: EasyBMP_View.h                  *
+*    date added: 10-19-2026                      *
+* date modified: 10-19-2026                      *
+*       version: 1.06                            *
+*                                                *
+*   License: BSD (revised/modified)              *
+* Copyright: 2005-6 by the EasyBMP Project       *
+*                                                *
+* description: Defines non-owning pixel views    *
+*                                                *
+*************************************************/
+
+#ifndef _EasyBMP_View_h_
+#define _EasyBMP_View_h_
+
+class BMP;
+
+// A BMPView is a window onto pixels owned by someone else: an origin,
+// a size and the distance (in pixels) between horizontal and vertical
+// neighbours. Crops and mirrors only move the origin and change the
+// strides, so they are O(1) and never copy pixel data. A view does not
+// keep its image alive, and resizing the image invalidates the view.
+//
+// A view of a BMP may write to its pixels, so viewing an image that
+// shares pixels with copies of it allocates and copies the whole image,
+// giving the view one block of its own; until SetSize or a read replaces
+// the pixels, later copies of the image then duplicate its pixels instead
+// of sharing them. A view of a const BMP is O(1) and leaves sharing
+// alone, but must only be read from. It needs the pixels in one block,
+// which they stay in unless the image wrote to some of them while they
+// were shared; such an image yields an empty view.
+
+class BMPView {
+public:
+ RGBApixel* Origin;
+ int Width;
+ int Height;
+ std::ptrdiff_t ColumnStride; // from pixel (i,j) to pixel (i+1,j)
+ std::ptrdiff_t RowStride;    // from pixel (i,j) to pixel (i,j+1)
+
+ BMPView();
+ BMPView(BMP& Image);
+ BMPView(const BMP& Image);
+ BMPView(RGBApixel* Origin, int Width, int Height,
+         std::ptrdiff_t ColumnStride, std::ptrdiff_t RowStride);
+
+ // no bounds checking; use Crop() to restrict a view first
+ RGBApixel& operator()(int i, int j) const
+ { return Origin[i * ColumnStride + j * RowStride]; }
+
+ BMPView Crop(int Left, int Top, int NewWidth, int NewHeight) const;
+ BMPView FlipHorizontal(void) const;
+ BMPView FlipVertical(void) const;
+};
+
+// A PixelBuffer describes pixels in caller-owned memory, laid out as one
+// of the PixelFormat layouts, so BMP can write them without a copy. Rows
+// are Stride bytes apart, starting with the top row at Data; a negative
+// Stride suits bottom-up memory. Like a view, it owns nothing.
+
+class PixelBuffer {
+public:
+ const void* Data;
+ int Width;
+ int Height;
+ std::ptrdiff_t Stride;
+ PixelFormat Format;
+
+ PixelBuffer();
+ PixelBuffer(const void* Data, int Width, int Height,
+             std::ptrdiff_t Stride, PixelFormat Format);
+};
+
+#endif
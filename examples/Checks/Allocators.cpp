@@ -0,0 +1,116 @@
+// Where pixel memory comes from and when it goes back: every block an
+// image takes is returned with the size it was asked for, small images
+// take none, and arena images may outlive the arena's Release().
+
+#include "Checks.h"
+#include <cstdint>
+#include <map>
+
+// Passes blocks through to the pooled allocator and keeps account.
+class Counting : public BMPAllocator {
+public:
+	void* Allocate(std::size_t Size)
+	{
+		void* Block = BMPAllocator::Pooled().Allocate(Size);
+		Live[Block] = Size;
+		Calls++;
+		if ((std::uintptr_t) Block % Alignment) Misaligned++;
+		return Block;
+	}
+	void Deallocate(void* Block, std::size_t Size)
+	{
+		auto Found = Live.find(Block);
+		if (Found == Live.end() or Found->second != Size) Mismatched++;
+		else Live.erase(Found);
+		BMPAllocator::Pooled().Deallocate(Block, Size);
+	}
+
+	std::map<void*, std::size_t> Live;
+	int Calls = 0;
+	int Misaligned = 0;
+	int Mismatched = 0;
+};
+
+static void Balanced(void)
+{
+	Counting Memory;
+	{
+		BMP Image(Memory);
+		Image.SetSize(300, 200);
+		Fill(Image, 47);
+		CHECK(Memory.Calls > 0);
+		CHECK((std::uintptr_t) &Image(0, 0) % BMPAllocator::Alignment == 0);
+
+		// copies take their memory from the same place, shared or not
+		BMP Copy(Image);
+		Copy(10, 10).Red ^= 1;
+		BMP Assigned;
+		Assigned = Image;
+		Assigned(20, 20).Red ^= 1;
+		Image.SetSize(50, 50);
+		Image.SetSize(400, 10);
+
+		Bytes File = WriteToBytes(Copy);
+		BMP Read(Memory);
+		CHECK(Read.TryReadFromBuffer(File.data(), File.size()));
+		Read.SetBitDepth(8);
+	}
+	CHECK(Memory.Live.empty());
+	CHECK(Memory.Misaligned == 0 and Memory.Mismatched == 0);
+
+	// images constructed while Memory is the thread's allocator use it
+	BMP::allocator(&Memory);
+	int Before = Memory.Calls;
+	{
+		BMP Image;
+		Image.SetSize(100, 100);
+	}
+	BMP::allocator(nullptr);
+	CHECK(Memory.Calls > Before and Memory.Live.empty());
+}
+
+static void Small(void)
+{
+	Counting Memory;
+	{
+		BMP Icon(Memory);
+		for (int Size = 1; Size <= 16; Size++) {
+			Icon.SetSize(Size, 17 - Size);
+			Fill(Icon, (unsigned) Size);
+			BMP Copy(Icon);
+			Copy(0, 0).Red ^= 1;
+		}
+		CHECK(Memory.Calls == 0);
+		Icon.SetSize(17, 17);
+		CHECK(Memory.Calls > 0);
+	}
+	CHECK(Memory.Live.empty());
+}
+
+static void Arena(void)
+{
+	BMPArena Arena(1 << 16);
+	std::vector<BMP*> Images;
+	for (int n = 0; n < 20; n++) {
+		Images.push_back(new BMP(Arena));
+		Images.back()->SetSize(40 + n, 30);
+		Fill(*Images.back(), (unsigned) n);
+	}
+
+	// a copy shares the arena's pixels and can still write its own
+	BMP Copy(*Images[3]);
+	Copy(1, 1).Red ^= 0xFF;
+	CHECK(Copy(1, 1).Red != (*Images[3])(1, 1).Red);
+	CHECK(Copy(2, 2).Red == (*Images[3])(2, 2).Red);
+
+	// the arena may give its chunks back before the images go
+	Arena.Release();
+	for (BMP* Image : Images) delete Image;
+}
+
+void CheckAllocators(void)
+{
+	Balanced();
+	Small();
+	Arena();
+}
@@ -0,0 +1,90 @@
+// 32-bit BI_BITFIELDS and BI_ALPHABITFIELDS files, byte-aligned masks in
+// every order as well as narrow and wide fields, against a per-pixel
+// reference.
+
+#include "Checks.h"
+
+// the top eight bits of the field, scaled so its maximum reads as 255
+static ebmpBYTE Field(ebmpDWORD Value, ebmpDWORD Mask)
+{
+	if (not Mask) return 0;
+	int Shift = 0, Bits = 0;
+	while (not ((Mask >> Shift) & 1)) Shift++;
+	while (Shift + Bits < 32 and ((Mask >> (Shift + Bits)) & 1)) Bits++;
+	if (Bits > 8) { Shift += Bits - 8; Bits = 8; }
+	ebmpDWORD Max = (1u << Bits) - 1;
+	return (ebmpBYTE) ((((Value >> Shift) & Max) * 255 + Max / 2) / Max);
+}
+
+// Without an alpha mask, Alpha gets the one byte that red, green and blue
+// leave unused when each of them is a whole byte, and 0 otherwise.
+static ebmpBYTE SpareByte(ebmpDWORD Value, const ebmpDWORD Masks[3])
+{
+	int Used = 0;
+	for (int c = 0; c < 3; c++) {
+		for (int k = 0; k < 4; k++) {
+			if (Masks[c] == 0xFFu << (8 * k)) Used |= 1 << k;
+		}
+	}
+	for (int k = 0; k < 4; k++) {
+		if (Used == (15 & ~(1 << k))) return (ebmpBYTE) (Value >> (8 * k));
+	}
+	return 0;
+}
+
+static void CheckMasks(std::vector<ebmpDWORD> Masks, int Width)
+{
+	FileSpec Spec;
+	Spec.Width = Width;
+	Spec.Height = 3;
+	Spec.BitCount = 32;
+	Spec.Compression = Masks.size() == 4 ? 6 : 3;
+	Spec.Masks = Masks;
+	std::vector<ebmpDWORD> Values;
+	unsigned Seed = (unsigned) Width * 7919u + Masks[0];
+	for (int n = 0; n < Width * Spec.Height; n++) {
+		Seed = Seed * 1664525u + 1013904223u;
+		Values.push_back(Seed);
+		PutDWORD(Spec.Pixels, Seed);
+	}
+	Bytes File = Build(Spec);
+
+	BMP Image;
+	CHECK(Image.TryReadFromBuffer(File.data(), File.size()));
+	CHECK(Image.TellBitDepth() == 32);
+	bool Matches = true;
+	for (int j = 0; j < Spec.Height; j++) {
+		for (int i = 0; i < Width; i++) {
+			// rows are stored bottom-up
+			ebmpDWORD Value = Values[(Spec.Height - 1 - j) * Width + i];
+			RGBApixel P = Image.GetPixel(i, j);
+			ebmpBYTE Alpha = Masks.size() == 4 and Masks[3] ? Field(Value, Masks[3]) : SpareByte(Value, Masks.data());
+			Matches = Matches and P.Red == Field(Value, Masks[0]) and P.Green == Field(Value, Masks[1]) and
+					  P.Blue == Field(Value, Masks[2]) and P.Alpha == Alpha;
+		}
+	}
+	CHECK(Matches);
+}
+
+void CheckBitFields(void)
+{
+	const ebmpDWORD Byte[4] = { 0xFFu, 0xFF00u, 0xFF0000u, 0xFF000000u };
+
+	// widths that cover both the four-pixel kernels and their tails
+	for (int Width : { 1, 3, 4, 5, 17, 64 }) {
+		// red, green and blue in every arrangement of three of the four bytes
+		for (int r = 0; r < 4; r++) {
+			for (int g = 0; g < 4; g++) {
+				for (int b = 0; b < 4; b++) {
+					if (r == g or g == b or r == b) continue;
+					CheckMasks({ Byte[r], Byte[g], Byte[b] }, Width);
+					CheckMasks({ Byte[r], Byte[g], Byte[b], Byte[6 - r - g - b] }, Width);
+				}
+			}
+		}
+		CheckMasks({ 0xF800, 0x07E0, 0x001F }, Width);                       // 5-6-5
+		CheckMasks({ 0x3FF00000, 0x000FFC00, 0x000003FF, 0xC0000000 }, Width); // 10-10-10-2
+		CheckMasks({ 0, 0xFF00, 0xFF }, Width);                               // no red
+		CheckMasks({ 0xFF0000, 0xFF00, 0xFF, 0 }, Width);                     // no alpha
+	}
+}
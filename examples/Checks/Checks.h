@@ -0,0 +1,54 @@
+#ifndef _Checks_h_
+#define _Checks_h_
+
+#include "EasyBMP.h"
+#include <string>
+#include <vector>
+
+// Counts a failed expectation and reports where it was; main() returns
+// the count as its exit status.
+void Fail(const char* File, int Line, const char* What);
+#define CHECK(Condition) \
+	do { if (not (Condition)) Fail(__FILE__, __LINE__, #Condition); } while (0)
+
+typedef std::vector<ebmpBYTE> Bytes;
+
+void PutWORD(Bytes& Out, ebmpWORD Value);
+void PutDWORD(Bytes& Out, ebmpDWORD Value);
+
+// A BMP file assembled by hand, for headers and encodings the library
+// never writes itself. Pixels holds the pixel data exactly as it is to
+// appear in the file; Build() lays out the file header, an info header
+// of InfoSize bytes (the masks go inside it when it has room, after it
+// otherwise), the palette, Gap unused bytes and the pixels, and fills in
+// the sizes.
+struct FileSpec {
+	int InfoSize = 40;
+	int Width = 1;
+	int Height = 1;
+	int BitCount = 24;
+	int Compression = 0;
+	std::vector<ebmpDWORD> Masks;
+	std::vector<RGBApixel> Palette;
+	int Gap = 0;
+	Bytes Pixels;
+};
+Bytes Build(const FileSpec& Spec);
+
+// a repeatable pseudo-random pattern, with Alpha set as well
+void Fill(BMP& Image, unsigned Seed);
+bool SamePixels(const BMP& A, const BMP& B);
+Bytes WriteToBytes(BMP& Image);
+
+void CheckRLE(void);
+void CheckBitFields(void);
+void CheckInfoHeaders(void);
+void CheckDecodeInto(void);
+void CheckErrors(void);
+void CheckLimits(void);
+void CheckSharing(void);
+void CheckAllocators(void);
+void CheckRotate(void);
+void CheckComposite(void);
+
+#endif
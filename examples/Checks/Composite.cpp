@@ -0,0 +1,168 @@
+// Compositing against the textbook Porter-Duff formulas, worked out one
+// pixel at a time with plain division, for every mode in straight and
+// premultiplied alpha and at run lengths either side of the four pixels
+// the vector path takes at once.
+
+#include "Checks.h"
+
+static const BlendMode Modes[] = {
+	BlendMode::Over, BlendMode::In, BlendMode::Out, BlendMode::Atop,
+	BlendMode::Add, BlendMode::Multiply, BlendMode::Copy
+};
+
+// round(a * b / 255); a * b / 255 is never exactly halfway
+static int Times(int a, int b)
+{
+	return (2 * a * b + 255) / 510;
+}
+
+static int Clamp(int Value)
+{
+	return Value > 255 ? 255 : Value;
+}
+
+static int Reference(int s, int d, int as, int ad, BlendMode Mode)
+{
+	switch (Mode) {
+	case BlendMode::Over:     return Clamp(s + Times(d, 255 - as));
+	case BlendMode::In:       return Times(s, ad);
+	case BlendMode::Out:      return Times(s, 255 - ad);
+	case BlendMode::Atop:     return Clamp(Times(s, ad) + Times(d, 255 - as));
+	case BlendMode::Add:      return Clamp(s + d);
+	case BlendMode::Multiply: return Clamp(Times(s, d) + Times(s, 255 - ad) + Times(d, 255 - as));
+	case BlendMode::Copy:     return s;
+	}
+	return 0;
+}
+
+static RGBApixel Expected(RGBApixel Source, RGBApixel Destination, BlendMode Mode, bool Premultiplied)
+{
+	// a copy takes the source as it is, without a round trip through
+	// premultiplied alpha
+	if (Mode == BlendMode::Copy) return Source;
+	int s[4] = { Source.Blue, Source.Green, Source.Red, Source.Alpha };
+	int d[4] = { Destination.Blue, Destination.Green, Destination.Red, Destination.Alpha };
+	if (not Premultiplied) {
+		for (int c = 0; c < 3; c++) {
+			s[c] = Times(s[c], s[3]);
+			d[c] = Times(d[c], d[3]);
+		}
+	}
+	int o[4];
+	for (int c = 0; c < 4; c++) o[c] = Reference(s[c], d[c], s[3], d[3], Mode);
+	// back to straight alpha: round(C * 255 / A)
+	if (not Premultiplied and o[3] != 255) {
+		for (int c = 0; c < 3; c++) o[c] = o[3] ? Clamp((510 * o[c] + o[3]) / (2 * o[3])) : 0;
+	}
+	RGBApixel Out;
+	Out.Blue = (ebmpBYTE) o[0];
+	Out.Green = (ebmpBYTE) o[1];
+	Out.Red = (ebmpBYTE) o[2];
+	Out.Alpha = (ebmpBYTE) o[3];
+	return Out;
+}
+
+static bool Same(RGBApixel P, RGBApixel Q)
+{
+	return P.Red == Q.Red and P.Green == Q.Green and P.Blue == Q.Blue and P.Alpha == Q.Alpha;
+}
+
+// Fill() with the extremes of alpha mixed in, and with colours no larger
+// than alpha when the image is to be read as premultiplied.
+static void Prepare(BMP& Image, unsigned Seed, bool Premultiplied)
+{
+	Fill(Image, Seed);
+	for (int i = 0; i < Image.AbsWidth(); i++) {
+		for (int j = 0; j < Image.AbsHeight(); j++) {
+			RGBApixel& P = Image(i, j);
+			if ((i + j) % 5 == 0) P.Alpha = 0;
+			if ((i + j) % 5 == 1) P.Alpha = 255;
+			if (Premultiplied) {
+				if (P.Red > P.Alpha) P.Red = P.Alpha;
+				if (P.Green > P.Alpha) P.Green = P.Alpha;
+				if (P.Blue > P.Alpha) P.Blue = P.Alpha;
+			}
+		}
+	}
+}
+
+static void Formulas(BlendMode Mode, bool Premultiplied, int Rows)
+{
+	BMP Source, Destination;
+	Source.SetSize(6, Rows + 2);
+	Destination.SetSize(8, Rows + 3);
+	Prepare(Source, (unsigned) Rows, Premultiplied);
+	Prepare(Destination, (unsigned) Rows + 1000, Premultiplied);
+	BMP Before(Destination);
+
+	// columns 1..4 and rows 1..Rows of the source land at (2, 1)
+	RangedPixelToPixelComposite(Source, 1, 4, Rows, 1, Destination, 2, 1, Mode, Premultiplied);
+
+	bool Matches = true;
+	for (int x = 0; x < Destination.AbsWidth(); x++) {
+		for (int y = 0; y < Destination.AbsHeight(); y++) {
+			bool Inside = x >= 2 and x <= 5 and y >= 1 and y <= Rows;
+			RGBApixel Want = Inside ? Expected(Source(x - 1, y), Before(x, y), Mode, Premultiplied) : Before(x, y);
+			Matches = Matches and Same(Destination(x, y), Want);
+		}
+	}
+	CHECK(Matches);
+}
+
+// An image composited onto itself reads the source as it was before.
+static void Overlapping(void)
+{
+	BMP Image;
+	Image.SetSize(40, 40);
+	Prepare(Image, 27, false);
+	BMP Before(Image);
+	RangedPixelToPixelComposite(Image, 0, 29, 29, 0, Image, 5, 3, BlendMode::Over);
+
+	bool Matches = true;
+	for (int x = 5; x < 35; x++) {
+		for (int y = 3; y < 33; y++) {
+			Matches = Matches and Same(Image(x, y), Expected(Before(x - 5, y - 3), Before(x, y), BlendMode::Over, false));
+		}
+	}
+	CHECK(Matches);
+}
+
+// One tiled pass over several layers gives what compositing them one
+// after another does.
+static void Layers(void)
+{
+	BMP Background, Top, Bottom;
+	Background.SetSize(150, 300);
+	Top.SetSize(70, 200);
+	Bottom.SetSize(90, 150);
+	Prepare(Background, 60, false);
+	Prepare(Top, 61, false);
+	Prepare(Bottom, 62, false);
+	RGBApixel Key = Bottom(3, 3);
+
+	BMP Original(Background);
+	BMP Sequential(Background);
+	RangedPixelToPixelComposite(Bottom, 0, 89, 149, 0, Sequential, 20, 100, BlendMode::Multiply);
+	RangedPixelToPixelComposite(Top, 5, 69, 199, 10, Sequential, 40, 60, BlendMode::Over);
+	RangedPixelToPixelComposite(Original, 0, 49, 49, 0, Sequential, 100, 250, BlendMode::Atop);
+	RangedPixelToPixelCopyTransparent(Bottom, 0, 89, 149, 0, Sequential, -10, -20, Key);
+
+	std::vector<CompositeLayer> Stack;
+	Stack.push_back(CompositeLayer(Bottom, 0, 89, 149, 0, 20, 100, BlendMode::Multiply));
+	Stack.push_back(CompositeLayer(Top, 5, 69, 199, 10, 40, 60));
+	Stack.push_back(CompositeLayer(Background, 0, 49, 49, 0, 100, 250, BlendMode::Atop));
+	Stack.push_back(CompositeLayer(Bottom, 0, 89, 149, 0, -10, -20, Key));
+	FlattenLayers(Background, Stack);
+	CHECK(SamePixels(Background, Sequential));
+}
+
+void CheckComposite(void)
+{
+	for (BlendMode Mode : Modes) {
+		for (bool Premultiplied : { false, true }) {
+			for (int Rows = 1; Rows <= 13; Rows++) Formulas(Mode, Premultiplied, Rows);
+		}
+	}
+	Overlapping();
+	Layers();
+}
@@ -0,0 +1,98 @@
+// BMP::DecodeInto in every PixelFormat, top-down and bottom-up, against
+// the pixels ReadFromBuffer gives for the same file.
+
+#include "Checks.h"
+
+static const PixelFormat Formats[] = {
+	PixelFormat::RGB8, PixelFormat::BGR8, PixelFormat::RGBA8, PixelFormat::BGRA8, PixelFormat::Gray8
+};
+
+static int BytesPerPixel(PixelFormat Format)
+{
+	switch (Format) {
+	case PixelFormat::RGB8:
+	case PixelFormat::BGR8:
+		return 3;
+	case PixelFormat::Gray8:
+		return 1;
+	default:
+		return 4;
+	}
+}
+
+// pixel P as Format lays it out in memory
+static Bytes Expected(const RGBApixel& P, PixelFormat Format)
+{
+	switch (Format) {
+	case PixelFormat::RGB8:  return { P.Red, P.Green, P.Blue };
+	case PixelFormat::BGR8:  return { P.Blue, P.Green, P.Red };
+	case PixelFormat::RGBA8: return { P.Red, P.Green, P.Blue, P.Alpha };
+	case PixelFormat::BGRA8: return { P.Blue, P.Green, P.Red, P.Alpha };
+	case PixelFormat::Gray8: return { (ebmpBYTE) ((77 * P.Red + 150 * P.Green + 29 * P.Blue + 128) >> 8) };
+	}
+	return {};
+}
+
+static void DecodeFile(const Bytes& File)
+{
+	BMP Reference;
+	CHECK(Reference.TryReadFromBuffer(File.data(), File.size()));
+	int Width = 0, Height = 0;
+	CHECK(BMP::ReadDimensions(File.data(), File.size(), Width, Height));
+	CHECK(Width == Reference.AbsWidth() and Height == Reference.AbsHeight());
+
+	for (PixelFormat Format : Formats) {
+		for (bool BottomUp : { false, true }) {
+			// rows padded with bytes the decoder must leave alone
+			size_t Stride = (size_t) Width * BytesPerPixel(Format) + 5;
+			Bytes Target(Stride * Height, 0xA5);
+			CHECK(BMP::DecodeInto(File.data(), File.size(), Target.data(), Stride, Format, BottomUp));
+
+			bool Matches = true;
+			for (int j = 0; j < Height; j++) {
+				const ebmpBYTE* Row = Target.data() + Stride * (BottomUp ? Height - 1 - j : j);
+				for (int i = 0; i < Width; i++) {
+					Bytes Want = Expected(Reference.GetPixel(i, j), Format);
+					for (size_t k = 0; k < Want.size(); k++) {
+						Matches = Matches and Row[i * Want.size() + k] == Want[k];
+					}
+				}
+				for (size_t k = (size_t) Width * BytesPerPixel(Format); k < Stride; k++) {
+					Matches = Matches and Row[k] == 0xA5;
+				}
+			}
+			CHECK(Matches);
+		}
+	}
+}
+
+void CheckDecodeInto(void)
+{
+	for (int BitDepth : { 1, 4, 8, 16, 24, 32 }) {
+		for (bool RLE : { false, true }) {
+			if (RLE and BitDepth != 4 and BitDepth != 8) continue;
+			BMP Image;
+			Image.SetSize(37, 11);
+			Fill(Image, (unsigned) BitDepth);
+			Image.SetBitDepth(BitDepth);
+			Image.SetRLECompression(RLE);
+			DecodeFile(WriteToBytes(Image));
+		}
+	}
+
+	// a bit-field file the library does not write itself
+	FileSpec Spec;
+	Spec.Width = 6;
+	Spec.Height = 2;
+	Spec.BitCount = 32;
+	Spec.Compression = 6;
+	Spec.Masks = { 0xFF00, 0xFF0000, 0xFF000000, 0xFF };
+	for (int n = 0; n < 48; n++) Spec.Pixels.push_back((ebmpBYTE) (n * 37));
+	DecodeFile(Build(Spec));
+
+	// DecodeInto reports failure for a file it cannot read
+	Bytes Broken = Build(Spec);
+	Broken[0] = 'X';
+	Bytes Target(64);
+	CHECK(not BMP::DecodeInto(Broken.data(), Broken.size(), Target.data(), 24, PixelFormat::BGRA8));
+}
@@ -0,0 +1,134 @@
+// The error codes and byte offsets the Try* calls report, and what they
+// leave behind when they fail.
+
+#include "Checks.h"
+#include <sstream>
+
+static Bytes Valid(void)
+{
+	FileSpec Spec;
+	Spec.Width = 3;
+	Spec.Height = 2;
+	Spec.Pixels.assign(2 * 12, 7);
+	return Build(Spec);
+}
+
+static BMPStatus Read(const Bytes& File)
+{
+	BMP Image;
+	return Image.TryReadFromBuffer(File.data(), File.size());
+}
+
+static bool Is(BMPStatus Status, BMPError Error, size_t Offset)
+{
+	return Status.Error == Error and Status.Offset == Offset;
+}
+
+static void ReadCodes(void)
+{
+	Bytes File = Valid();
+	CHECK(Is(Read(File), BMPError::None, File.size()));
+	CHECK(Is(Read(Bytes()), BMPError::Truncated, 0));
+	CHECK(Is(Read(Bytes(File.begin(), File.begin() + 30)), BMPError::Truncated, 30));
+
+	Bytes NotBMP = File;
+	NotBMP[1] = 'X';
+	CHECK(Is(Read(NotBMP), BMPError::NotBMP, 2));
+
+	// every header problem is noticed once both headers are in, 54 bytes in
+	FileSpec Spec;
+	Spec.Width = 3;
+	Spec.Height = 2;
+	Spec.Pixels.assign(24, 7);
+
+	FileSpec Core = Spec;
+	Core.InfoSize = 12;
+	CHECK(Is(Read(Build(Core)), BMPError::UnsupportedHeader, 54));
+
+	FileSpec Odd = Spec;
+	Odd.BitCount = 7;
+	CHECK(Is(Read(Build(Odd)), BMPError::UnsupportedFormat, 54));
+	Odd = Spec;
+	Odd.Compression = 1; // RLE8 in a 24-bit file
+	CHECK(Is(Read(Build(Odd)), BMPError::UnsupportedFormat, 54));
+	Odd.Compression = 3; // bit fields in a 24-bit file
+	CHECK(Is(Read(Build(Odd)), BMPError::UnsupportedFormat, 54));
+	Odd.Compression = 4; // JPEG
+	CHECK(Is(Read(Build(Odd)), BMPError::UnsupportedFormat, 54));
+
+	FileSpec Empty = Spec;
+	Empty.Width = 0;
+	CHECK(Is(Read(Build(Empty)), BMPError::BadDimensions, 54));
+	Empty.Width = -3;
+	CHECK(Is(Read(Build(Empty)), BMPError::BadDimensions, 54));
+	Empty = Spec;
+	Empty.Height = 0;
+	CHECK(Is(Read(Build(Empty)), BMPError::BadDimensions, 54));
+
+	BMP Image;
+	CHECK(Is(Image.TryReadFromFile("no/such/directory/file.bmp"), BMPError::CannotOpen, 0));
+
+	std::istringstream Whole(std::string(File.begin(), File.end()));
+	CHECK(Is(Image.TryReadFromStream(Whole), BMPError::None, File.size()));
+	std::istringstream Cut(std::string(File.begin(), File.end() - 3));
+	CHECK(Image.TryReadFromStream(Cut).Error == BMPError::Truncated);
+}
+
+static void WriteCodes(void)
+{
+	BMP Image;
+	Image.SetSize(3, 2);
+	std::ostringstream Out;
+	BMPStatus Status = Image.TryWriteToStream(Out);
+	CHECK(Is(Status, BMPError::None, Out.str().size()));
+
+	std::ostringstream Broken;
+	Broken.setstate(std::ios::badbit);
+	CHECK(Image.TryWriteToStream(Broken).Error == BMPError::WriteFailed);
+	CHECK(Image.TryWriteToFile("no/such/directory/file.bmp").Error == BMPError::CannotOpen);
+}
+
+// A rejected file leaves the image as it was, and Try* never throws,
+// whatever the thread's exception policy.
+static void Failures(void)
+{
+	BMP Image;
+	Image.SetSize(4, 4);
+	Image(1, 2).Red = 17;
+
+	BMP::ExceptionScope Throwing(true);
+	bool Threw = false;
+	try {
+		Bytes NotBMP = Valid();
+		NotBMP[0] = 0;
+		CHECK(Image.TryReadFromBuffer(NotBMP.data(), NotBMP.size()).Error == BMPError::NotBMP);
+		Bytes Short = Valid();
+		Short.resize(Short.size() - 1);
+		CHECK(Image.TryReadFromBuffer(Short.data(), Short.size()).Error == BMPError::Truncated);
+		CHECK(Image.TryReadFromFile("no/such/directory/file.bmp").Error == BMPError::CannotOpen);
+	}
+	catch (...) {
+		Threw = true;
+	}
+	CHECK(not Threw);
+	CHECK(Image.AbsWidth() == 4 and Image.AbsHeight() == 4 and Image(1, 2).Red == 17);
+
+	// the plain calls do throw under that policy
+	Threw = false;
+	try {
+		Bytes NotBMP = Valid();
+		NotBMP[0] = 0;
+		Image.ReadFromBuffer(NotBMP.data(), NotBMP.size());
+	}
+	catch (const std::exception&) {
+		Threw = true;
+	}
+	CHECK(Threw);
+}
+
+void CheckErrors(void)
+{
+	ReadCodes();
+	WriteCodes();
+	Failures();
+}
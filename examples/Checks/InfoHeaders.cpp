@@ -0,0 +1,91 @@
+// Files with BITMAPINFOHEADER, BITMAPV4HEADER and BITMAPV5HEADER info
+// headers, with the pixel data where bfOffBits puts it rather than
+// straight after the palette.
+
+#include "Checks.h"
+
+static const int InfoSizes[] = { 40, 108, 124 };
+
+static void TrueColor(int InfoSize, int Gap, bool TopDown)
+{
+	const int Width = 5, Height = 4;
+	FileSpec Spec;
+	Spec.InfoSize = InfoSize;
+	Spec.Width = Width;
+	Spec.Height = TopDown ? -Height : Height;
+	Spec.Gap = Gap;
+	for (int r = 0; r < Height; r++) {
+		for (int i = 0; i < Width; i++) {
+			Spec.Pixels.push_back((ebmpBYTE) (10 * i));   // blue
+			Spec.Pixels.push_back((ebmpBYTE) (20 * r));   // green
+			Spec.Pixels.push_back((ebmpBYTE) (200 + i + r));
+		}
+		Spec.Pixels.push_back(0); // rows are padded to 4 bytes
+	}
+	Bytes File = Build(Spec);
+
+	BMP Image;
+	CHECK(Image.TryReadFromBuffer(File.data(), File.size()));
+	CHECK(Image.AbsWidth() == Width and Image.AbsHeight() == Height);
+	bool Matches = true;
+	for (int j = 0; j < Height; j++) {
+		int r = TopDown ? j : Height - 1 - j;
+		for (int i = 0; i < Width; i++) {
+			RGBApixel P = Image.GetPixel(i, j);
+			Matches = Matches and P.Blue == 10 * i and P.Green == 20 * r and P.Red == 200 + i + r;
+		}
+	}
+	CHECK(Matches);
+}
+
+static void Paletted(int InfoSize, int Gap)
+{
+	FileSpec Spec;
+	Spec.InfoSize = InfoSize;
+	Spec.Width = 3;
+	Spec.Height = 2;
+	Spec.BitCount = 8;
+	Spec.Gap = Gap;
+	Spec.Palette = { { 1, 2, 3, 0 }, { 4, 5, 6, 0 }, { 7, 8, 9, 0 } };
+	Spec.Pixels = { 2, 1, 0, 0,   0, 0, 2, 0 };
+	Bytes File = Build(Spec);
+
+	BMP Image;
+	CHECK(Image.TryReadFromBuffer(File.data(), File.size()));
+	CHECK(Image.TellBitDepth() == 8);
+	CHECK(Image.GetPixel(0, 1).Blue == 7 and Image.GetPixel(1, 1).Blue == 4 and Image.GetPixel(2, 1).Blue == 1);
+	CHECK(Image.GetPixel(0, 0).Red == 3 and Image.GetPixel(1, 0).Red == 3 and Image.GetPixel(2, 0).Red == 9);
+}
+
+// V4 and V5 headers carry an alpha mask of their own
+static void AlphaMask(int InfoSize)
+{
+	FileSpec Spec;
+	Spec.InfoSize = InfoSize;
+	Spec.Width = 2;
+	Spec.Height = 1;
+	Spec.BitCount = 32;
+	Spec.Compression = 3;
+	Spec.Masks = { 0xFF, 0xFF00, 0xFF0000, 0xFF000000 }; // RGBA in memory order
+	Spec.Pixels = { 10, 20, 30, 40,   50, 60, 70, 80 };
+	Bytes File = Build(Spec);
+
+	BMP Image;
+	CHECK(Image.TryReadFromBuffer(File.data(), File.size()));
+	RGBApixel P = Image.GetPixel(0, 0), Q = Image.GetPixel(1, 0);
+	CHECK(P.Red == 10 and P.Green == 20 and P.Blue == 30 and P.Alpha == 40);
+	CHECK(Q.Red == 50 and Q.Green == 60 and Q.Blue == 70 and Q.Alpha == 80);
+}
+
+void CheckInfoHeaders(void)
+{
+	for (int InfoSize : InfoSizes) {
+		for (int Gap : { 0, 2, 37 }) {
+			TrueColor(InfoSize, Gap, false);
+			TrueColor(InfoSize, Gap, true);
+			Paletted(InfoSize, Gap);
+		}
+	}
+	AlphaMask(108);
+	AlphaMask(124);
+}
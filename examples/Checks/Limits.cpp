@@ -0,0 +1,147 @@
+// Decoding limits and files cut short: every such file is rejected from
+// its headers, before any pixel memory is allocated, and leaves the image
+// as it was.
+
+#include "Checks.h"
+#include <thread>
+
+static BMPStatus ReadInto(BMP& Image, const Bytes& File)
+{
+	return Image.TryReadFromBuffer(File.data(), File.size());
+}
+
+static bool Untouched(const BMP& Image)
+{
+	return Image.AbsWidth() == 2 and Image.AbsHeight() == 2 and Image(1, 1).Green == 99;
+}
+
+static void Marked(BMP& Image)
+{
+	Image.SetSize(2, 2);
+	Image(1, 1).Green = 99;
+}
+
+static FileSpec Sized(int Width, int Height)
+{
+	FileSpec Spec;
+	Spec.Width = Width;
+	Spec.Height = Height;
+	Spec.Pixels.assign((size_t) Height * ((3 * Width + 3) / 4 * 4), 1);
+	return Spec;
+}
+
+static void Limits(void)
+{
+	BMPLimits Defaults;
+	CHECK(Defaults.MaxWidth == 1 << 16 and Defaults.MaxHeight == 1 << 16);
+	CHECK(Defaults.MaxPixels == 1LL << 25 and Defaults.MaxBytes == 1LL << 28);
+
+	Bytes File = Build(Sized(20, 10));
+	BMP Image;
+	Marked(Image);
+
+	BMPLimits Tight;
+	Tight.MaxWidth = 19;
+	BMP::limits(Tight);
+	CHECK(ReadInto(Image, File).Error == BMPError::LimitExceeded);
+	Tight = BMPLimits();
+	Tight.MaxHeight = 9;
+	BMP::limits(Tight);
+	CHECK(ReadInto(Image, File).Error == BMPError::LimitExceeded);
+	Tight = BMPLimits();
+	Tight.MaxPixels = 199;
+	BMP::limits(Tight);
+	CHECK(ReadInto(Image, File).Error == BMPError::LimitExceeded);
+	Tight = BMPLimits();
+	Tight.MaxBytes = (long long) File.size() - 1;
+	BMP::limits(Tight);
+	CHECK(ReadInto(Image, File).Error == BMPError::LimitExceeded);
+	CHECK(Untouched(Image));
+
+	// limits belong to the thread that set them
+	BMPStatus Elsewhere = { BMPError::None, 0 };
+	std::thread Other([&] { BMP Fresh; Elsewhere = ReadInto(Fresh, File); });
+	Other.join();
+	CHECK(Elsewhere);
+
+	Tight.MaxBytes = (long long) File.size();
+	BMP::limits(Tight);
+	CHECK(ReadInto(Image, File));
+	BMP::limits(BMPLimits());
+}
+
+// Headers that claim far more than the file holds.
+static void Hostile(void)
+{
+	BMP Image;
+	Marked(Image);
+
+	// beyond the default pixel limit
+	FileSpec Huge = Sized(1, 1);
+	Huge.Width = 60000;
+	Huge.Height = 60000;
+	CHECK(ReadInto(Image, Build(Huge)).Error == BMPError::LimitExceeded);
+
+	// within the limits, but the file is a few bytes long
+	FileSpec Claims = Sized(1, 1);
+	Claims.Width = 5000;
+	Claims.Height = 5000;
+	CHECK(ReadInto(Image, Build(Claims)).Error == BMPError::Truncated);
+	Bytes Undeclared = Build(Claims);
+	for (int k = 2; k < 6; k++) Undeclared[k] = 0;
+	CHECK(ReadInto(Image, Undeclared).Error == BMPError::Truncated);
+
+	// RLE data declared longer than what follows the headers
+	FileSpec RLE;
+	RLE.Width = 4;
+	RLE.Height = 4;
+	RLE.BitCount = 8;
+	RLE.Compression = 1;
+	RLE.Pixels = { 4, 0, 0, 1 };
+	Bytes Long = Build(RLE);
+	Long[34] = 0xFF;
+	Long[35] = 0xFF;
+	for (int k = 2; k < 6; k++) Long[k] = 0;
+	CHECK(ReadInto(Image, Long).Error == BMPError::Truncated);
+	CHECK(Untouched(Image));
+}
+
+// Every prefix of a file, for a few kinds of file.
+static void Prefixes(void)
+{
+	std::vector<Bytes> Files;
+	Files.push_back(Build(Sized(7, 5)));
+
+	FileSpec V5 = Sized(7, 5);
+	V5.InfoSize = 124;
+	V5.Gap = 9;
+	Files.push_back(Build(V5));
+
+	BMP Source;
+	Source.SetSize(9, 6);
+	Fill(Source, 45);
+	Source.SetBitDepth(8);
+	Files.push_back(WriteToBytes(Source));
+	Source.SetRLECompression(true);
+	Files.push_back(WriteToBytes(Source));
+
+	for (const Bytes& File : Files) {
+		bool AllRejected = true;
+		for (size_t Length = 0; Length < File.size(); Length++) {
+			BMP Image;
+			Marked(Image);
+			BMPStatus Status = Image.TryReadFromBuffer(File.data(), Length);
+			AllRejected = AllRejected and Status.Error == BMPError::Truncated and Untouched(Image);
+		}
+		CHECK(AllRejected);
+		BMP Image;
+		CHECK(ReadInto(Image, File));
+	}
+}
+
+void CheckLimits(void)
+{
+	Limits();
+	Hostile();
+	Prefixes();
+}
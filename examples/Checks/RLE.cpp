@@ -0,0 +1,150 @@
+// RLE8 and RLE4: hand-made files that use every escape, what the
+// decoder makes of data that stops early, and encoder round trips.
+
+#include "Checks.h"
+
+static const RGBApixel Palette[4] = {
+	{ 10, 10, 10, 0 }, { 0, 0, 255, 0 }, { 0, 255, 0, 0 }, { 255, 0, 0, 0 }
+};
+
+// Whether row j of Image, left to right, shows these palette indices.
+static bool RowIs(const BMP& Image, int j, const std::vector<int>& Indices)
+{
+	for (int i = 0; i < (int) Indices.size(); i++) {
+		RGBApixel P = Image.GetPixel(i, j), Q = Palette[Indices[i]];
+		if (P.Red != Q.Red or P.Green != Q.Green or P.Blue != Q.Blue) return false;
+	}
+	return true;
+}
+
+static FileSpec RLE8Escapes(void)
+{
+	FileSpec Spec;
+	Spec.Width = 6;
+	Spec.Height = 3;
+	Spec.BitCount = 8;
+	Spec.Compression = 1;
+	Spec.Palette.assign(Palette, Palette + 4);
+	Spec.Pixels = {
+		2, 1,                 // a run of two 1s
+		0, 3, 2, 3, 1, 0,     // three literal pixels, padded to a word
+		0, 0,                 // end of line; the last pixel keeps index 0
+		0, 2, 3, 1,           // delta: 3 right, 1 up, skipping a whole row
+		2, 2,                 // a run of two 2s from x = 3
+		0, 1                  // end of bitmap
+	};
+	return Spec;
+}
+
+static FileSpec RLE4Escapes(void)
+{
+	FileSpec Spec;
+	Spec.Width = 6;
+	Spec.Height = 2;
+	Spec.BitCount = 4;
+	Spec.Compression = 2;
+	Spec.Palette.assign(Palette, Palette + 4);
+	Spec.Pixels = {
+		4, 0x12,              // 1 2 1 2
+		2, 0x30,              // 3 0
+		0, 0,                 // end of line
+		0, 3, 0x31, 0x20,     // three literal nibbles, already word aligned
+		0, 2, 1, 0,           // delta: 1 right
+		1, 0x30,              // a single 3
+		0, 1                  // end of bitmap
+	};
+	return Spec;
+}
+
+static void DecodeEscapes(void)
+{
+	Bytes File = Build(RLE8Escapes());
+	BMP Image;
+	CHECK(Image.TryReadFromBuffer(File.data(), File.size()));
+	CHECK(Image.TellBitDepth() == 8);
+	CHECK(Image.TellRLECompression());
+	// rows are stored bottom-up
+	CHECK(RowIs(Image, 2, { 1, 1, 2, 3, 1, 0 }));
+	CHECK(RowIs(Image, 1, { 0, 0, 0, 0, 0, 0 }));
+	CHECK(RowIs(Image, 0, { 0, 0, 0, 2, 2, 0 }));
+
+	File = Build(RLE4Escapes());
+	CHECK(Image.TryReadFromBuffer(File.data(), File.size()));
+	CHECK(Image.TellBitDepth() == 4);
+	CHECK(RowIs(Image, 1, { 1, 2, 1, 2, 3, 0 }));
+	CHECK(RowIs(Image, 0, { 3, 1, 2, 0, 3, 0 }));
+}
+
+static void DecodeTruncated(void)
+{
+	FileSpec Spec = RLE8Escapes();
+	Bytes Whole = Build(Spec);
+
+	// cut inside the data, with the headers still declaring its full size
+	for (size_t Cut = 1; Cut < Spec.Pixels.size(); Cut++) {
+		BMP Image;
+		BMPStatus Status = Image.TryReadFromBuffer(Whole.data(), Whole.size() - Cut);
+		CHECK(Status.Error == BMPError::Truncated);
+	}
+
+	// without a declared size the decoder reads until the data runs out;
+	// it still reports the truncation, and keeps the rows it finished
+	Spec.Pixels.resize(10);
+	Bytes Short = Build(Spec);
+	for (int k = 34; k < 38; k++) Short[k] = 0;
+	BMP Image;
+	BMPStatus Status = Image.TryReadFromBuffer(Short.data(), Short.size());
+	CHECK(Status.Error == BMPError::Truncated);
+	CHECK(Image.AbsWidth() == 6 and Image.AbsHeight() == 3);
+	CHECK(RowIs(Image, 2, { 1, 1, 2, 3, 1, 0 }));
+}
+
+// Rows of runs, short runs and noise, in colours from the image's own
+// palette so the round trip is exact.
+static void EncodeRoundTrip(int BitDepth, int Width, int Height)
+{
+	BMP Image;
+	Image.SetSize(Width, Height);
+	Image.SetBitDepth(BitDepth);
+	int Colors = Image.TellNumberOfColors();
+	unsigned Seed = (unsigned) (Width * 31 + Height);
+	for (int j = 0; j < Height; j++) {
+		for (int i = 0; i < Width; ) {
+			Seed = Seed * 1103515245u + 12345u;
+			int Run = j % 3 == 0 ? 1 : 1 + (int) (Seed >> 16) % (j % 3 == 1 ? 4 : 300);
+			int Index = (int) (Seed >> 8) % Colors;
+			for (int k = 0; k < Run and i < Width; k++, i++) {
+				// RLE4 runs may alternate two indices
+				int Pick = BitDepth == 4 and k % 2 ? (Index + 5) % Colors : Index;
+				Image(i, j) = Image.GetColor(Pick);
+			}
+		}
+	}
+
+	Image.SetRLECompression(false);
+	Bytes Plain = WriteToBytes(Image);
+	Image.SetRLECompression(true);
+	Bytes Packed = WriteToBytes(Image);
+	CHECK(Packed.size() > 34 and Packed[30] == (BitDepth == 8 ? 1 : 2));
+
+	BMP Copy;
+	CHECK(Copy.TryReadFromBuffer(Packed.data(), Packed.size()));
+	CHECK(Copy.TellRLECompression());
+	CHECK(SamePixels(Image, Copy));
+
+	// mostly long runs, so compression has to pay off
+	if (Width >= 64 and Height >= 6) CHECK(Packed.size() < Plain.size());
+}
+
+void CheckRLE(void)
+{
+	DecodeEscapes();
+	DecodeTruncated();
+
+	for (int BitDepth : { 8, 4 }) {
+		for (int Width : { 1, 2, 3, 5, 64, 255, 256, 257, 1000 }) {
+			EncodeRoundTrip(BitDepth, Width, 7);
+		}
+		EncodeRoundTrip(BitDepth, 300, 300);
+	}
+}
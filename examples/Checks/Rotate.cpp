@@ -0,0 +1,84 @@
+// Rotations and transposition against a pixel-by-pixel reference, at
+// sizes around the 4x4 blocks the fast path moves, into another image and
+// onto the source itself.
+
+#include "Checks.h"
+
+enum Turn { Quarter, Half, ThreeQuarters, Transposed };
+
+// where pixel (i, j) of a Width x Height image lands
+static void Target(Turn Kind, int Width, int Height, int i, int j, int& x, int& y)
+{
+	switch (Kind) {
+	case Quarter:       x = Height - 1 - j; y = i; break;
+	case Half:          x = Width - 1 - i;  y = Height - 1 - j; break;
+	case ThreeQuarters: x = j;              y = Width - 1 - i; break;
+	case Transposed:    x = j;              y = i; break;
+	}
+}
+
+static bool Apply(Turn Kind, BMP& From, BMP& To)
+{
+	switch (Kind) {
+	case Quarter:       return Rotate90(From, To);
+	case Half:          To = From; return Rotate180(To);
+	case ThreeQuarters: return Rotate270(From, To);
+	case Transposed:    return Transpose(From, To);
+	}
+	return false;
+}
+
+static void Compare(Turn Kind, int Width, int Height, bool InPlace)
+{
+	BMP Source;
+	Source.SetSize(Width, Height);
+	Fill(Source, (unsigned) (Width * 131 + Height));
+	BMP Reference(Source);
+	// a shared source as well, so the rotation must not write through it
+	BMP Keep(Source);
+
+	BMP Result;
+	CHECK(InPlace ? Apply(Kind, Source, Source) : Apply(Kind, Source, Result));
+	BMP& Out = InPlace ? Source : Result;
+
+	bool Swapped = Kind != Half;
+	CHECK(Out.AbsWidth() == (Swapped ? Height : Width) and Out.AbsHeight() == (Swapped ? Width : Height));
+	bool Matches = true;
+	for (int i = 0; i < Width; i++) {
+		for (int j = 0; j < Height; j++) {
+			int x = 0, y = 0;
+			Target(Kind, Width, Height, i, j, x, y);
+			RGBApixel P = Reference.GetPixel(i, j), Q = Out.GetPixel(x, y);
+			Matches = Matches and P.Red == Q.Red and P.Green == Q.Green and P.Blue == Q.Blue and P.Alpha == Q.Alpha;
+		}
+	}
+	CHECK(Matches);
+	CHECK(SamePixels(Keep, Reference));
+}
+
+static void Palette(void)
+{
+	BMP Source;
+	Source.SetSize(5, 3);
+	Source.SetBitDepth(8);
+	RGBApixel Odd = { 1, 2, 3, 0 };
+	Source.SetColor(7, Odd);
+	Source.SetDPI(300, 150);
+	BMP Result;
+	CHECK(Rotate90(Source, Result));
+	CHECK(Result.TellBitDepth() == 8 and Result.GetColor(7).Red == 3);
+	CHECK(Result.TellHorizontalDPI() == Source.TellVerticalDPI());
+}
+
+void CheckRotate(void)
+{
+	for (Turn Kind : { Quarter, Half, ThreeQuarters, Transposed }) {
+		for (int Width : { 1, 3, 4, 5, 8, 17, 70 }) {
+			for (int Height : { 1, 2, 4, 7, 16, 33 }) {
+				Compare(Kind, Width, Height, false);
+				Compare(Kind, Width, Height, true);
+			}
+		}
+	}
+	Palette();
+}
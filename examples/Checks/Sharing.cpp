@@ -0,0 +1,121 @@
+// Copies share pixels until one side writes; every write must stay on
+// the side that made it, whichever side that is and however the copies
+// were made.
+
+#include "Checks.h"
+#include <thread>
+
+static void BothWays(int Width, int Height)
+{
+	BMP Original;
+	Original.SetSize(Width, Height);
+	Fill(Original, 50);
+	BMP Before(Original);
+
+	// the copy writes first
+	BMP Copy(Original);
+	Copy(Width - 1, 0).Red ^= 0xFF;
+	CHECK(SamePixels(Original, Before));
+	CHECK(not SamePixels(Copy, Before));
+
+	// then the original writes to a column the copy still shares
+	Original(0, Height - 1).Blue ^= 0xFF;
+	CHECK(Copy(0, Height - 1).Blue == Before(0, Height - 1).Blue);
+	CHECK(Original(Width - 1, 0).Red == Before(Width - 1, 0).Red);
+
+	// a copy of a copy that has already written
+	BMP Third;
+	Third = Copy;
+	Third(Width - 1, 0).Green ^= 0xFF;
+	Copy(0, 0).Alpha ^= 0xFF;
+	CHECK(Third(Width - 1, 0).Red == Copy(Width - 1, 0).Red);
+	CHECK(Third(Width - 1, 0).Green != Copy(Width - 1, 0).Green);
+	CHECK(Third(0, 0).Alpha != Copy(0, 0).Alpha);
+
+	// resizing one leaves the others alone, and so does assigning an
+	// image to itself
+	Copy.SetSize(3, 3);
+	CHECK(Third.AbsWidth() == Width and Third.AbsHeight() == Height);
+	Third = Third;
+	CHECK(Third(Width - 1, 0).Red == (Before(Width - 1, 0).Red ^ 0xFF));
+}
+
+static void AcrossAllocators(void)
+{
+	BMPArena Arena;
+	BMP Original(Arena);
+	Original.SetSize(40, 30);
+	Fill(Original, 51);
+	BMP Before(Original);
+
+	BMP Pooled;
+	Pooled = Original;
+	Pooled(5, 5).Red ^= 0xFF;
+	Original(6, 6).Red ^= 0xFF;
+	CHECK(Pooled(6, 6).Red == Before(6, 6).Red);
+	Original(6, 6).Red ^= 0xFF;
+	CHECK(SamePixels(Original, Before));
+}
+
+static void Views(void)
+{
+	BMP Original;
+	Original.SetSize(30, 20);
+	Fill(Original, 52);
+	BMP Copy(Original);
+
+	// a read-only view of a shared image keeps showing what it showed
+	const BMP& Shared = Copy;
+	BMPView Look(Shared);
+	CHECK(Look.Origin != nullptr and Look(4, 4).Red == Original(4, 4).Red);
+	RGBApixel Seen = Look(4, 4);
+	Original(4, 4).Red ^= 0xFF;
+	CHECK(Look(4, 4).Red == Seen.Red and Copy(4, 4).Red == Seen.Red);
+
+	// writing through a view of one image does not reach the other
+	BMPView Write(Copy);
+	Write(7, 7).Green ^= 0xFF;
+	CHECK(Original(7, 7).Green != Copy(7, 7).Green);
+	BMP Later(Copy);
+	Write(8, 8).Green ^= 0xFF;
+	CHECK(Later(8, 8).Green != Copy(8, 8).Green);
+}
+
+// Copies taken from one const image on several threads at once, each
+// then written.
+static void Concurrent(void)
+{
+	BMP Original;
+	Original.SetSize(64, 48);
+	Fill(Original, 53);
+	BMP Before(Original);
+	const BMP& Source = Original;
+
+	std::vector<std::thread> Threads;
+	std::vector<int> Wrong(4, 0);
+	for (int t = 0; t < 4; t++) {
+		Threads.emplace_back([&, t] {
+			for (int Round = 0; Round < 20; Round++) {
+				BMP Copy(Source);
+				for (int i = t; i < 64; i += 4) Copy(i, Round).Red = (ebmpBYTE) t;
+				for (int i = 0; i < 64; i++) {
+					bool Mine = i % 4 == t;
+					if (Copy(i, Round).Red != (Mine ? t : Before(i, Round).Red)) Wrong[t]++;
+				}
+			}
+		});
+	}
+	for (std::thread& Thread : Threads) Thread.join();
+	for (int Count : Wrong) CHECK(Count == 0);
+	CHECK(SamePixels(Original, Before));
+}
+
+void CheckSharing(void)
+{
+	BothWays(100, 80);
+	BothWays(16, 16);  // kept inline
+	BothWays(1, 300);
+	AcrossAllocators();
+	Views();
+	Concurrent();
+}
@@ -0,0 +1,124 @@
+// Behaviour checks for the library: each Check* function exercises one
+// feature through the public API and reports every expectation that
+// does not hold. The exit status is the number of failures.
+
+#include "Checks.h"
+#include <cstdio>
+#include <sstream>
+
+using namespace std;
+
+static int Failures = 0;
+
+void Fail(const char* File, int Line, const char* What)
+{
+	fprintf(stderr, "%s:%d: check failed: %s\n", File, Line, What);
+	Failures++;
+}
+
+void PutWORD(Bytes& Out, ebmpWORD Value)
+{
+	Out.push_back((ebmpBYTE) Value);
+	Out.push_back((ebmpBYTE) (Value >> 8));
+}
+
+void PutDWORD(Bytes& Out, ebmpDWORD Value)
+{
+	for (int k = 0; k < 4; k++) Out.push_back((ebmpBYTE) (Value >> (8 * k)));
+}
+
+Bytes Build(const FileSpec& Spec)
+{
+	// masks that do not fit in the info header follow it
+	int MaskRoom = Spec.InfoSize > 40 ? 0 : 4 * (int) Spec.Masks.size();
+	ebmpDWORD Offset = 14 + Spec.InfoSize + MaskRoom + 4 * (int) Spec.Palette.size() + Spec.Gap;
+
+	Bytes Out;
+	PutWORD(Out, 19778);
+	PutDWORD(Out, Offset + (ebmpDWORD) Spec.Pixels.size());
+	PutDWORD(Out, 0);
+	PutDWORD(Out, Offset);
+
+	PutDWORD(Out, Spec.InfoSize);
+	PutDWORD(Out, Spec.Width);
+	PutDWORD(Out, Spec.Height);
+	PutWORD(Out, 1);
+	PutWORD(Out, Spec.BitCount);
+	PutDWORD(Out, Spec.Compression);
+	PutDWORD(Out, (ebmpDWORD) Spec.Pixels.size());
+	PutDWORD(Out, 2835);
+	PutDWORD(Out, 2835);
+	PutDWORD(Out, (ebmpDWORD) Spec.Palette.size());
+	PutDWORD(Out, 0);
+	for (ebmpDWORD Mask : Spec.Masks) PutDWORD(Out, Mask);
+	while (Out.size() < 14 + (size_t) Spec.InfoSize) Out.push_back(0);
+
+	for (const RGBApixel& Color : Spec.Palette) {
+		Out.push_back(Color.Blue);
+		Out.push_back(Color.Green);
+		Out.push_back(Color.Red);
+		Out.push_back(0);
+	}
+	Out.insert(Out.end(), Spec.Gap, 0xEE);
+	Out.insert(Out.end(), Spec.Pixels.begin(), Spec.Pixels.end());
+	return Out;
+}
+
+void Fill(BMP& Image, unsigned Seed)
+{
+	for (int i = 0; i < Image.AbsWidth(); i++) {
+		for (int j = 0; j < Image.AbsHeight(); j++) {
+			unsigned Value = (i * 2654435761u) ^ (j * 40503u) ^ (Seed * 97u);
+			Value ^= Value >> 13;
+			Value *= 0x5bd1e995u;
+			Value ^= Value >> 15;
+			RGBApixel& P = Image(i, j);
+			P.Red = (ebmpBYTE) Value;
+			P.Green = (ebmpBYTE) (Value >> 8);
+			P.Blue = (ebmpBYTE) (Value >> 16);
+			P.Alpha = (ebmpBYTE) (Value >> 24);
+		}
+	}
+}
+
+bool SamePixels(const BMP& A, const BMP& B)
+{
+	if (A.AbsWidth() != B.AbsWidth() or A.AbsHeight() != B.AbsHeight()) return false;
+	for (int i = 0; i < A.AbsWidth(); i++) {
+		for (int j = 0; j < A.AbsHeight(); j++) {
+			RGBApixel P = A.GetPixel(i, j), Q = B.GetPixel(i, j);
+			if (P.Red != Q.Red or P.Green != Q.Green or P.Blue != Q.Blue or P.Alpha != Q.Alpha) return false;
+		}
+	}
+	return true;
+}
+
+Bytes WriteToBytes(BMP& Image)
+{
+	ostringstream Out;
+	Image.WriteToStream(Out);
+	string Written = Out.str();
+	return Bytes(Written.begin(), Written.end());
+}
+
+int main(void)
+{
+	// failures are reported by status, not by exception, unless a check
+	// turns exceptions on for itself
+	BMP::exceptions(false);
+
+	CheckRLE();
+	CheckBitFields();
+	CheckInfoHeaders();
+	CheckDecodeInto();
+	CheckErrors();
+	CheckLimits();
+	CheckSharing();
+	CheckAllocators();
+	CheckRotate();
+	CheckComposite();
+
+	if (Failures) fprintf(stderr, "%d checks failed\n", Failures);
+	else printf("all checks passed\n");
+	return Failures;
+}